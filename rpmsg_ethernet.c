@@ -39,72 +39,842 @@
 #include <linux/in.h>
 #include <linux/netdevice.h>   /* struct device, and other headers */
 #include <linux/etherdevice.h> /* eth_type_trans */
+#include <linux/if_arp.h>
 #include <linux/ip.h>          /* struct iphdr */
 #include <linux/tcp.h>         /* struct tcphdr */
 #include <linux/skbuff.h>
+#include <linux/ethtool.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <asm/unaligned.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/percpu.h>
+/* ndo_xdp with xdp_buff.data_hard_start */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+#define RPMSG_ETHER_XDP
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#endif
+#include <linux/jhash.h>
+#include <linux/bitmap.h>
+#include <net/ip.h>
 
 #include <linux/in6.h>
 #include <asm/checksum.h>
 
 #include "rpmsg_neo.h"
 #include "rpmsg_neoproxy.h"
+#include "rpmsg_neo_stats.h"
+#include "rpmsg_neo_trace.h"
 
 
 
+/*
+ * Per-CPU counters.  Every writer runs in softirq context or with bh
+ * disabled (rpmsg_ether_stat_add()), so one syncp per CPU is enough.
+ */
+struct rpmsg_ether_pcpu_stats {
+        u64 rx_packets;
+        u64 rx_bytes;
+        u64 rx_dropped;
+        u64 rx_length_errors;
+        u64 rx_frame_errors;
+        u64 tx_packets;
+        u64 tx_bytes;
+        u64 tx_dropped;
+        u64 tx_errors;
+        /* ethtool -S only */
+        u64 tx_busy;            /* waits for a free vring buffer */
+        u64 tx_oversize;        /* frames above the MTU, dropped not truncated */
+        u64 tx_frags;           /* link fragments sent */
+        u64 tx_aggr;            /* aggregated buffers sent */
+        u64 rx_frags;           /* link fragments received */
+        u64 rx_reasm;           /* frames reassembled from more than one */
+        u64 rx_reasm_timeout;
+        u64 rx_aggr;            /* aggregated buffers received */
+        u64 rx_cache_miss;      /* cache empty, allocated in the callback */
+        u64 rx_alloc_fail;
+        u64 rx_xdp_drop;        /* dropped or aborted by the XDP program */
+        u64 rx_xdp_tx;          /* bounced back to the M4 by the XDP program */
+        u64 tx_hc;              /* TCP segments sent with a compressed header */
+        u64 tx_hc_ctx;          /* header contexts sent */
+        u64 rx_hc;              /* compressed segments rebuilt */
+        u64 rx_hc_miss;         /* dropped for a lost or stale context */
+        struct u64_stats_sync syncp;
+};
+
+#define rpmsg_ether_stat_add(q, field, n)                               \
+    do {                                                                \
+        struct rpmsg_ether_pcpu_stats *_s;                              \
+                                                                        \
+        local_bh_disable();                                             \
+        _s = this_cpu_ptr((q)->pcpu_stats);                             \
+        u64_stats_update_begin(&_s->syncp);                             \
+        _s->field += (n);                                               \
+        u64_stats_update_end(&_s->syncp);                               \
+        local_bh_enable();                                              \
+    } while (0)
+
+#define rpmsg_ether_stat_inc(q, field)      rpmsg_ether_stat_add(q, field, 1)
+
+#define RPMSG_ETHER_MAX_QUEUES  4
+
+/*
+ * ethtool -C.  A direction coalesces when usecs is set: work is held
+ * back until frames are waiting or usecs have passed since the first.
+ * In adaptive mode that only happens while the queue is busy, above
+ * RPMSG_ETHER_ADAPT_PPS, and light traffic keeps its latency.
+ */
+#define RPMSG_ETHER_COAL_MAX_USECS      10000
+#define RPMSG_ETHER_COAL_MAX_FRAMES     1024
+#define RPMSG_ETHER_ADAPT_PPS           10000
+#define RPMSG_ETHER_ADAPT_NS            (10 * NSEC_PER_MSEC)   /* rate sample */
+
+struct rpmsg_ether_coal {
+        u32 usecs;
+        u32 frames;
+        bool adaptive;
+};
+
+struct rpmsg_ether_rate {
+        u64 start;              /* ns, current sample */
+        u32 count;
+        bool busy;              /* last sample was above RPMSG_ETHER_ADAPT_PPS */
+};
+
+/*
+ * Header compression (ether_hdr_comp=1).  A context is the part of an
+ * IPv4/TCP header (with the MAC header in front, if any) that stays the
+ * same for a flow, with the fields every segment carries zeroed.
+ */
+#define RPMSG_ETHER_HC_CONTEXTS         16
+#define RPMSG_ETHER_HC_HDR_MAX          (ETH_HLEN + 60 + sizeof(struct tcphdr))
+
+struct rpmsg_ether_hc_ctx {
+        bool valid;
+        u8 gen;                 /* bumped whenever the context is resent */
+        u8 len;
+        u8 hdr[RPMSG_ETHER_HC_HDR_MAX];
+};
+
+/*
+ * One TX/RX queue pair and the endpoint carrying it.  Queue n uses
+ * endpoint ETHERNET_ENDPOINT - n on both ends, and nothing here is
+ * shared with the other queues.
+ */
+struct rpmsg_ether_queue {
+        struct _rpmsg_dev_params *priv;
+        int index;
+        struct rpmsg_endpoint *ept;
+        char tx_buff[MAX_RPMSG_BUFF_SIZE]; /* buffer to keep the message to send */
+        struct rpmsg_ether_pcpu_stats __percpu *pcpu_stats;
+        spinlock_t lock;                /* rx_frag_* */
+        int endpt;
+        char name[16];                  /* debugfs entry */
+        struct rpmsg_neo_stats ept_stats;
+        struct napi_struct napi;
+        struct sk_buff_head rx_queue;   /* callback -> NAPI poll */
+        struct sk_buff_head rx_cache;   /* preallocated PDU sized skbs */
+        struct sk_buff_head tx_queue;   /* xmit -> tx_work */
+        struct work_struct tx_work;
+        u16 tx_frag_id;                 /* tx_work */
+        unsigned int aggr_len;          /* bytes packed in tx_buff, tx_work */
+        unsigned int aggr_frames;
+        unsigned int aggr_bytes;
+        int aggr_flush;                 /* aggr_timer expired */
+        struct hrtimer aggr_timer;
+        struct sk_buff *rx_frag_skb;    /* frame being reassembled, lock */
+        u16 rx_frag_id;
+        u8 rx_frag_next;
+        struct timer_list rx_frag_timer;
+        struct hrtimer rx_coal_timer;   /* schedules NAPI */
+        struct rpmsg_ether_rate rx_rate;        /* callback */
+        struct hrtimer tx_coal_timer;   /* queues tx_work */
+        struct rpmsg_ether_rate tx_rate;        /* xmit lock */
+        bool hc_tx_on;                  /* the peer decompresses */
+        unsigned long hc_req_at;        /* last HC_REQ, open/tx_work */
+        struct rpmsg_ether_hc_ctx hc_tx[RPMSG_ETHER_HC_CONTEXTS];      /* tx_work */
+        struct rpmsg_ether_hc_ctx hc_rx[RPMSG_ETHER_HC_CONTEXTS];      /* callback */
+        DECLARE_BITMAP(hc_nack, RPMSG_ETHER_HC_CONTEXTS);      /* callback -> tx_work */
+};
+
 struct _rpmsg_dev_params {
 
         struct device *rpmsg_dev;
         struct rpmsg_channel *rpmsg_chnl;
-        struct rpmsg_endpoint *ept;
-        char tx_buff[MAX_RPMSG_BUFF_SIZE]; /* buffer to keep the message to send */
-        struct net_device_stats stats;
         struct net_device *dev;
-        spinlock_t lock;
-        int endpt;
+        struct workqueue_struct *tx_wq;
+#ifdef RPMSG_ETHER_XDP
+        struct bpf_prog __rcu *xdp_prog;        /* ndo_xdp, rtnl */
+#endif
+        struct rpmsg_ether_coal rx_coal;        /* ethtool -C, rtnl */
+        struct rpmsg_ether_coal tx_coal;
+        unsigned int num_queues;
+        struct rpmsg_ether_queue queues[RPMSG_ETHER_MAX_QUEUES];
 };
 
 
 static struct net_device *rpmsg_netdev;
 
+static unsigned int ether_queues = 1;
+module_param(ether_queues, uint, 0444);
+MODULE_PARM_DESC(ether_queues, "TX/RX queue pairs, each on its own endpoint counting down from 125");
+
+static unsigned int ether_rx_backlog = 1000;
+module_param(ether_rx_backlog, uint, 0644);
+MODULE_PARM_DESC(ether_rx_backlog, "received frames queued for NAPI before dropping");
+
+static unsigned int ether_rx_cache = 64;
+module_param(ether_rx_cache, uint, 0644);
+MODULE_PARM_DESC(ether_rx_cache, "receive skbs kept allocated ahead of the callback");
+
+static bool ether_raw_ip;
+module_param(ether_raw_ip, bool, 0444);
+MODULE_PARM_DESC(ether_raw_ip, "point-to-point interface carrying bare IP packets, no MAC header or ARP");
+
+static unsigned int ether_tx_backlog = 64;
+module_param(ether_tx_backlog, uint, 0644);
+MODULE_PARM_DESC(ether_tx_backlog, "frames queued for the vring before the TX queue is stopped");
+
+/* writable at runtime: 0 would stop the queues and never wake them */
+static inline unsigned int rpmsg_ether_tx_backlog(void)
+{
+    return max(READ_ONCE(ether_tx_backlog), 1U);
+}
+
+static bool ether_link_frag;
+module_param(ether_link_frag, bool, 0444);
+MODULE_PARM_DESC(ether_link_frag, "link header on every rpmsg, frames up to RPMSG_ETHER_LINK_MAX_MTU");
+
+static bool ether_aggr;
+module_param(ether_aggr, bool, 0444);
+MODULE_PARM_DESC(ether_aggr, "pack small frames into shared rpmsg buffers (implies ether_link_frag)");
+
+static unsigned int ether_aggr_max = 256;
+module_param(ether_aggr_max, uint, 0644);
+MODULE_PARM_DESC(ether_aggr_max, "largest frame that is aggregated");
+
+static unsigned int ether_aggr_us = 50;
+module_param(ether_aggr_us, uint, 0644);
+MODULE_PARM_DESC(ether_aggr_us, "longest a packed frame waits for more to share its buffer");
+
+static unsigned int ether_frag_timeout_ms = 50;
+module_param(ether_frag_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(ether_frag_timeout_ms, "drop a partly reassembled frame after this long");
+
+static bool ether_hdr_comp;
+module_param(ether_hdr_comp, bool, 0444);
+MODULE_PARM_DESC(ether_hdr_comp, "compress IPv4/TCP headers once the peer agrees (implies ether_link_frag)");
+
 /*
- * The higher levels take care of making this non-reentrant (it's
- * called with bh's disabled).
+ * Link framing (ether_link_frag=1).  Every rpmsg starts with this header
+ * so a frame larger than one rpmsg buffer can travel as a run of
+ * fragments with the same id and consecutive frag numbers.  A frame
+ * that fits is a single RPMSG_ETHER_LINK_FRAG_END with frag 0.  With
+ * ether_aggr=1 small frames share one RPMSG_ETHER_LINK_AGGR buffer as
+ * { le16 len; u8 frame[len]; } records, a zero len ends the list early.
+ * Both ends have to be loaded with the same framing.
+ *
+ * With ether_hdr_comp=1 each end sends RPMSG_ETHER_CTRL_HC_REQ when the
+ * interface comes up, and again at most once a second while it has
+ * frames to send and no answer, and compresses only after the peer has
+ * answered (HC_ACK) or asked itself; a peer that ignores the request
+ * gets full headers.  A context goes out as RPMSG_ETHER_LINK_HC_CTX
+ * { u8 gen; u8 len; u8 hdr[len]; } before the first segment that uses
+ * it, and segments that fit one rpmsg then travel as RPMSG_ETHER_LINK_HC
+ * { struct rpmsg_ether_hc_hdr; TCP options; payload }, frag being the
+ * context id in both.  A segment whose context is missing or of another
+ * generation is dropped and answered with HC_NACK, after which the
+ * sender resends the context.
  */
-static netdev_tx_t rpmsg_ether_xmit(struct sk_buff *skb,
-                            struct net_device *dev)
+#define RPMSG_ETHER_LINK_FRAG_MORE      1       /* fragment, more follow */
+#define RPMSG_ETHER_LINK_FRAG_END       2       /* last (or only) fragment */
+#define RPMSG_ETHER_LINK_AGGR           3       /* packed small frames */
+#define RPMSG_ETHER_LINK_HC_CTX         4       /* header context, frag = context id */
+#define RPMSG_ETHER_LINK_HC             5       /* compressed segment, frag = context id */
+#define RPMSG_ETHER_LINK_CTRL           6       /* no payload, frag = RPMSG_ETHER_CTRL_* */
+
+#define RPMSG_ETHER_CTRL_HC_REQ         1       /* I decompress, forget my contexts */
+#define RPMSG_ETHER_CTRL_HC_ACK         2
+#define RPMSG_ETHER_CTRL_HC_NACK        3       /* id = context id I have no match for */
+
+struct rpmsg_ether_link_hdr
 {
-    struct _rpmsg_dev_params *priv = netdev_priv(dev);
-    int len =0;
-    int err =0;
+    u8     type;        /* RPMSG_ETHER_LINK_* */
+    u8     frag;        /* fragment number within the frame, 0 first */
+    __le16 id;          /* frame number, wraps */
+} __packed;
+
+#define RPMSG_ETHER_LINK_PAYLOAD        (ETHERNET_PDU_SIZE - sizeof(struct rpmsg_ether_link_hdr))
+#define RPMSG_ETHER_LINK_MTU            1500
+#define RPMSG_ETHER_LINK_MAX_MTU        9000
 
-  //  skb_orphan(skb);
+/* what a compressed segment carries of the headers it replaces */
+struct rpmsg_ether_hc_hdr
+{
+    u8     gen;         /* of the context */
+    u8     flags;       /* TCP flags byte */
+    __be16 ip_id;
+    __be32 seq;
+    __be32 ack_seq;
+    __be16 window;
+    __be16 check;       /* TCP checksum, end to end */
+} __packed;
+
+#define RPMSG_ETHER_TCP_FLAGS(th)       (((u8 *)(th))[13])
+
+/* largest MTU whose TCP segments still compress into one rpmsg */
+#define RPMSG_ETHER_HC_MTU              (RPMSG_ETHER_LINK_PAYLOAD + sizeof(struct iphdr) + \
+                                         sizeof(struct tcphdr) - sizeof(struct rpmsg_ether_hc_hdr))
+
+/* one rpmsg, sleeping for a free TX buffer if the vring has none */
+static int rpmsg_ether_send(struct rpmsg_ether_queue *q, void *data, int len)
+{
+    int err;
 
-    /* Before queueing this packet to netif_rx(),
-     * make sure dst is refcounted.
+    err = rpmsg_trysendto(q->priv->rpmsg_chnl, data, len, q->endpt);
+    if (err == -ENOMEM)
+    {
+        u64 start = ktime_get_ns();
+
+        rpmsg_ether_stat_inc(q, tx_busy);
+        err = rpmsg_sendto(q->priv->rpmsg_chnl, data, len, q->endpt);
+        atomic64_add(ktime_get_ns() - start, &q->ept_stats.blocked_ns);
+    }
+
+    return err;
+}
+
+/* link control message, from any context that may sleep on the vring lock */
+static void rpmsg_ether_ctrl(struct rpmsg_ether_queue *q, u8 op, u16 arg)
+{
+    struct rpmsg_ether_link_hdr msg = {
+        .type = RPMSG_ETHER_LINK_CTRL,
+        .frag = op,
+        .id   = cpu_to_le16(arg),
+    };
+
+    /*
+     * Never waits for a buffer.  A lost HC_REQ is repeated by tx_work, a
+     * lost NACK by the next segment that misses the context; a lost ACK
+     * leaves the peer asking again.
      */
-   // skb_dst_force(skb);
+    if (rpmsg_trysendto(q->priv->rpmsg_chnl, &msg, sizeof(msg), q->endpt))
+        atomic64_inc(&q->ept_stats.send_fail);
+}
 
-   // skb->protocol = eth_type_trans(skb, dev);
+/*
+ * Copy len bytes at off of skb to to, fragments and all.  A checksum the
+ * stack left to us (CHECKSUM_PARTIAL) is filled in from csum, computed
+ * over the whole frame beforehand, if its field falls in the range.
+ */
+static void rpmsg_ether_copy_bits(struct sk_buff *skb, unsigned int off, u8 *to,
+                                  unsigned int len, __sum16 csum)
+{
+    unsigned int pos = skb_checksum_start_offset(skb) + skb->csum_offset;
+    int i;
 
-    len = skb->len;
-    
-    if (len > ETHERNET_PDU_SIZE)
-      len = ETHERNET_PDU_SIZE;
-  
-    spin_lock_bh(&priv->lock);
-
-    err = rpmsg_trysendto(priv->rpmsg_chnl,
-                          skb->data, 
-                          len, 
-                          priv->endpt);
-    
-    spin_unlock_bh(&priv->lock);
+    skb_copy_bits(skb, off, to, len);
+
+    if (skb->ip_summed != CHECKSUM_PARTIAL)
+        return;
 
+    for (i = 0; i < sizeof(csum); i++)
+        if (pos + i >= off && pos + i < off + len)
+            to[pos + i - off] = ((u8 *)&csum)[i];
+}
+
+/*
+ * One frame, split into link fragments when framing is on.  Paged skbs
+ * (NETIF_F_SG) are gathered straight into tx_buff, with the checksum
+ * computed on the way, so the stack never has to linearize them.
+ */
+static int rpmsg_ether_tx_frame(struct rpmsg_ether_queue *q, struct sk_buff *skb)
+{
+    struct rpmsg_ether_link_hdr *hdr = (struct rpmsg_ether_link_hdr *)q->tx_buff;
+    unsigned int off = 0;
+    __sum16 csum = 0;
+    u8 frag = 0;
+    int err;
+
+    if (!ether_link_frag)
+    {
+        /* the rpmsg core copies it into the vring anyway */
+        if (!skb_is_nonlinear(skb) && skb->ip_summed != CHECKSUM_PARTIAL)
+            return rpmsg_ether_send(q, skb->data, skb->len);
+
+        skb_copy_and_csum_dev(skb, q->tx_buff);
+        return rpmsg_ether_send(q, q->tx_buff, skb->len);
+    }
+
+    /* one buffer: copy and checksum in a single pass */
+    if (skb->len <= RPMSG_ETHER_LINK_PAYLOAD)
+    {
+        hdr->type = RPMSG_ETHER_LINK_FRAG_END;
+        hdr->frag = 0;
+        hdr->id = cpu_to_le16(q->tx_frag_id++);
+        skb_copy_and_csum_dev(skb, (u8 *)(hdr + 1));
+
+        err = rpmsg_ether_send(q, q->tx_buff, sizeof(*hdr) + skb->len);
+        if (!err)
+            rpmsg_ether_stat_inc(q, tx_frags);
+
+        return err;
+    }
+
+    /* the first fragment may carry the checksum field, sum before splitting */
+    if (skb->ip_summed == CHECKSUM_PARTIAL)
+    {
+        unsigned int start = skb_checksum_start_offset(skb);
+
+        csum = csum_fold(skb_checksum(skb, start, skb->len - start, 0));
+    }
+
+    do
+    {
+        unsigned int chunk = min_t(unsigned int, skb->len - off, RPMSG_ETHER_LINK_PAYLOAD);
+
+        hdr->type = off + chunk == skb->len ? RPMSG_ETHER_LINK_FRAG_END :
+                                              RPMSG_ETHER_LINK_FRAG_MORE;
+        hdr->frag = frag++;
+        hdr->id = cpu_to_le16(q->tx_frag_id);
+        rpmsg_ether_copy_bits(skb, off, (u8 *)(hdr + 1), chunk, csum);
+
+        err = rpmsg_ether_send(q, q->tx_buff, sizeof(*hdr) + chunk);
+        if (err)
+            break;
+
+        rpmsg_ether_stat_inc(q, tx_frags);
+
+        off += chunk;
+    }
+    while (off < skb->len);
+
+    q->tx_frag_id++;
+
+    return err;
+}
+
+/*
+ * Copy the header of an IPv4 TCP segment that can be compressed into
+ * norm, with every field a compressed segment carries zeroed.  Returns
+ * its length, 0 if the segment has to go out as it is.  SYN, FIN and RST
+ * always do, so flows start and end with full headers.
+ */
+static unsigned int rpmsg_ether_hc_parse(struct sk_buff *skb, u8 *norm)
+{
+    unsigned int l2 = ether_raw_ip ? 0 : ETH_HLEN;
+    unsigned int ihl, len;
+    struct iphdr *iph;
+    struct tcphdr *th;
+
+    if (skb_headlen(skb) < l2 + sizeof(*iph))
+        return 0;
+
+    if (l2 && ((struct ethhdr *)skb->data)->h_proto != htons(ETH_P_IP))
+        return 0;
+
+    iph = (struct iphdr *)(skb->data + l2);
+    ihl = iph->ihl * 4;
+    if (iph->version != 4 || ihl < sizeof(*iph) || iph->protocol != IPPROTO_TCP ||
+        (iph->frag_off & htons(IP_MF | IP_OFFSET)) ||
+        ntohs(iph->tot_len) != skb->len - l2)
+        return 0;
+
+    len = l2 + ihl + sizeof(*th);
+    if (skb_headlen(skb) < len)
+        return 0;
+
+    th = (struct tcphdr *)(skb->data + l2 + ihl);
+    if (th->doff * 4 < sizeof(*th) || skb_headlen(skb) < l2 + ihl + th->doff * 4 ||
+        th->syn || th->fin || th->rst || th->urg || th->urg_ptr)
+        return 0;
+
+    memcpy(norm, skb->data, len);
+
+    iph = (struct iphdr *)(norm + l2);
+    iph->tot_len = 0;
+    iph->id = 0;
+    iph->check = 0;
+
+    th = (struct tcphdr *)(norm + l2 + ihl);
+    th->seq = 0;
+    th->ack_seq = 0;
+    RPMSG_ETHER_TCP_FLAGS(th) = 0;
+    th->window = 0;
+    th->check = 0;
+
+    return len;
+}
+
+/*
+ * Send skb with a compressed header, preceded by its context if the peer
+ * does not have it yet.  Returns 1 when the segment has to go out as it
+ * is: no agreement with the peer, not TCP, or too large for one rpmsg
+ * even compressed.
+ */
+static int rpmsg_ether_hc_tx(struct rpmsg_ether_queue *q, struct sk_buff *skb)
+{
+    struct rpmsg_ether_link_hdr *hdr = (struct rpmsg_ether_link_hdr *)q->tx_buff;
+    struct rpmsg_ether_hc_hdr *hc = (struct rpmsg_ether_hc_hdr *)(hdr + 1);
+    u8 norm[RPMSG_ETHER_HC_HDR_MAX];
+    struct rpmsg_ether_hc_ctx *ctx;
+    unsigned int len, rest, cid;
+    struct iphdr *iph;
+    struct tcphdr *th;
+    int err;
+
+    if (!READ_ONCE(q->hc_tx_on))
+        return 1;
+
+    len = rpmsg_ether_hc_parse(skb, norm);
+    if (!len)
+        return 1;
+
+    /* TCP options and payload */
+    rest = skb->len - len;
+    if (sizeof(*hdr) + sizeof(*hc) + rest > ETHERNET_PDU_SIZE)
+        return 1;
+
+    /* we fill in a partial checksum, it has to be TCP's */
+    if (skb->ip_summed == CHECKSUM_PARTIAL &&
+        skb_checksum_start_offset(skb) != len - sizeof(*th))
+        return 1;
+
+    iph = (struct iphdr *)(skb->data + (ether_raw_ip ? 0 : ETH_HLEN));
+    th = (struct tcphdr *)((u8 *)iph + iph->ihl * 4);
+
+    cid = jhash_3words((__force u32)iph->saddr, (__force u32)iph->daddr,
+                       (__force u32)th->source << 16 | (__force u32)th->dest, 0) %
+          RPMSG_ETHER_HC_CONTEXTS;
+    ctx = &q->hc_tx[cid];
+
+    if (test_and_clear_bit(cid, q->hc_nack))
+        ctx->valid = false;
+
+    /* new flow in this slot, changed static fields, or the peer lost it */
+    if (!ctx->valid || ctx->len != len || memcmp(ctx->hdr, norm, len))
+    {
+        u8 *body = (u8 *)(hdr + 1);
+
+        ctx->gen++;
+        ctx->len = len;
+        memcpy(ctx->hdr, norm, len);
+
+        hdr->type = RPMSG_ETHER_LINK_HC_CTX;
+        hdr->frag = cid;
+        hdr->id = cpu_to_le16(q->tx_frag_id++);
+        body[0] = ctx->gen;
+        body[1] = len;
+        memcpy(body + 2, norm, len);
+
+        err = rpmsg_ether_send(q, q->tx_buff, sizeof(*hdr) + 2 + len);
+        ctx->valid = !err;
+        if (err)
+            return err;
+
+        rpmsg_ether_stat_inc(q, tx_hc_ctx);
+    }
+
+    hdr->type = RPMSG_ETHER_LINK_HC;
+    hdr->frag = cid;
+    hdr->id = cpu_to_le16(q->tx_frag_id++);
+    hc->gen = ctx->gen;
+    hc->flags = RPMSG_ETHER_TCP_FLAGS(th);
+    hc->ip_id = iph->id;
+    hc->seq = th->seq;
+    hc->ack_seq = th->ack_seq;
+    hc->window = th->window;
+
+    if (skb->ip_summed == CHECKSUM_PARTIAL)
+    {
+        /* the check field holds the pseudo header sum, 20 bytes keep the rest aligned */
+        __wsum csum = skb_copy_and_csum_bits(skb, len, (u8 *)(hc + 1), rest, 0);
+
+        hc->check = csum_fold(csum_add(csum_partial(th, sizeof(*th), 0), csum));
+    }
+    else
+    {
+        hc->check = th->check;
+        skb_copy_bits(skb, len, hc + 1, rest);
+    }
+
+    err = rpmsg_ether_send(q, q->tx_buff, sizeof(*hdr) + sizeof(*hc) + rest);
+    if (!err)
+        rpmsg_ether_stat_inc(q, tx_hc);
+
+    return err;
+}
+
+/* account one rpmsg worth of frames */
+static void rpmsg_ether_tx_done(struct rpmsg_ether_queue *q, int err,
+                                unsigned int frames, unsigned int bytes)
+{
+    struct rpmsg_ether_pcpu_stats *st;
 
     if (err < 0)
-        pr_err("ERROR: %s %s %d rc=%d no pkts\n", __FILE__, __FUNCTION__, __LINE__,err);
+    {
+        rpmsg_ether_stat_add(q, tx_dropped, frames);
+        rpmsg_ether_stat_inc(q, tx_errors);
+        atomic64_inc(&q->ept_stats.send_fail);
+        pr_err_ratelimited("ERROR: %s %s %d rc=%d no pkts\n", __FILE__, __FUNCTION__, __LINE__,err);
+        return;
+    }
+
+    local_bh_disable();
+    st = this_cpu_ptr(q->pcpu_stats);
+    u64_stats_update_begin(&st->syncp);
+    st->tx_packets += frames;
+    st->tx_bytes += bytes;
+    u64_stats_update_end(&st->syncp);
+    local_bh_enable();
+    rpmsg_neo_stats_tx(&q->ept_stats, bytes);
+    trace_rpmsg_neo_ether_xmit(q->endpt, q->endpt, bytes,
+                               skb_queue_len(&q->tx_queue));
+}
+
+/* send whatever is packed in tx_buff */
+static void rpmsg_ether_aggr_flush(struct rpmsg_ether_queue *q)
+{
+    struct rpmsg_ether_link_hdr *hdr = (struct rpmsg_ether_link_hdr *)q->tx_buff;
+    int err;
+
+    WRITE_ONCE(q->aggr_flush, 0);
+
+    if (!q->aggr_frames)
+        return;
+
+    hdr->type = RPMSG_ETHER_LINK_AGGR;
+    hdr->frag = 0;
+    hdr->id = cpu_to_le16(q->tx_frag_id++);
+
+    err = rpmsg_ether_send(q, q->tx_buff, q->aggr_len);
+    if (!err)
+        rpmsg_ether_stat_inc(q, tx_aggr);
+    rpmsg_ether_tx_done(q, err, q->aggr_frames, q->aggr_bytes);
+
+    q->aggr_len = 0;
+    q->aggr_frames = 0;
+    q->aggr_bytes = 0;
+}
+
+/* pack a small frame into tx_buff, sending the buffer first if it is full */
+static void rpmsg_ether_aggr_add(struct rpmsg_ether_queue *q, struct sk_buff *skb)
+{
+    __le16 rec_len = cpu_to_le16(skb->len);
+
+    if (q->aggr_len + sizeof(rec_len) + skb->len > ETHERNET_PDU_SIZE)
+        rpmsg_ether_aggr_flush(q);
+
+    if (!q->aggr_len)
+        q->aggr_len = sizeof(struct rpmsg_ether_link_hdr);
+
+    memcpy(q->tx_buff + q->aggr_len, &rec_len, sizeof(rec_len));
+    skb_copy_and_csum_dev(skb, (u8 *)q->tx_buff + q->aggr_len + sizeof(rec_len));
+    q->aggr_len += sizeof(rec_len) + skb->len;
+    q->aggr_frames++;
+    q->aggr_bytes += skb->len;
+}
+
+/* bounds how long a packed frame waits for company */
+static enum hrtimer_restart rpmsg_ether_aggr_timeout(struct hrtimer *timer)
+{
+    struct rpmsg_ether_queue *q = container_of(timer, struct rpmsg_ether_queue,
+                                               aggr_timer);
+
+    WRITE_ONCE(q->aggr_flush, 1);
+    queue_work(q->priv->tx_wq, &q->tx_work);
+
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * TX worker.  rpmsg_trysendto() may sleep on the vring lock, so frames
+ * are sent from here rather than from the xmit softirq.  When the M4 has
+ * not returned a TX buffer yet the worker sleeps in rpmsg_sendto(), which
+ * wakes on the vring's TX completion; the queue stays stopped meanwhile.
+ * Small frames are packed together until tx_buff is full, the queue runs
+ * dry and ether_aggr_us has passed, or a large frame has to go out.
+ */
+static void rpmsg_ether_tx_work(struct work_struct *work)
+{
+    struct rpmsg_ether_queue *q = container_of(work, struct rpmsg_ether_queue, tx_work);
+    struct netdev_queue *txq = netdev_get_tx_queue(q->priv->dev, q->index);
+    struct sk_buff *skb;
+
+    /* the request from open, or the peer's answer, may have been lost */
+    if (ether_hdr_comp && !READ_ONCE(q->hc_tx_on) &&
+        time_after(jiffies, q->hc_req_at + HZ))
+    {
+        q->hc_req_at = jiffies;
+        rpmsg_ether_ctrl(q, RPMSG_ETHER_CTRL_HC_REQ, 0);
+    }
+
+    while ((skb = skb_dequeue(&q->tx_queue)) != NULL)
+    {
+        unsigned int len = skb->len;
+
+        if (READ_ONCE(q->aggr_flush))
+            rpmsg_ether_aggr_flush(q);
+
+        if (ether_aggr && len <= min_t(unsigned int, ether_aggr_max,
+                                       RPMSG_ETHER_LINK_PAYLOAD - sizeof(__le16)))
+        {
+            rpmsg_ether_aggr_add(q, skb);
+        }
+        else
+        {
+            int err;
+
+            /* tx_buff is needed for fragments, and order is kept */
+            rpmsg_ether_aggr_flush(q);
+            err = ether_hdr_comp ? rpmsg_ether_hc_tx(q, skb) : 1;
+            if (err > 0)
+                err = rpmsg_ether_tx_frame(q, skb);
+            rpmsg_ether_tx_done(q, err, 1, len);
+        }
+
+        dev_consume_skb_any(skb);
+
+        /* BQL and queue wake raise NET_TX, run it on bh enable */
+        local_bh_disable();
+        netdev_tx_completed_queue(txq, 1, len);
+
+        /* pairs with the barrier in rpmsg_ether_xmit() */
+        smp_mb();
+        if (netif_tx_queue_stopped(txq) &&
+            skb_queue_len(&q->tx_queue) < rpmsg_ether_tx_backlog())
+            netif_tx_wake_queue(txq);
+        local_bh_enable();
+    }
+
+    /* drained: send the packed frames now or once the timer expires */
+    if (q->aggr_frames)
+    {
+        if (!ether_aggr_us || READ_ONCE(q->aggr_flush))
+            rpmsg_ether_aggr_flush(q);
+        else if (!hrtimer_active(&q->aggr_timer))
+            hrtimer_start(&q->aggr_timer,
+                          ns_to_ktime((u64)ether_aggr_us * NSEC_PER_USEC),
+                          HRTIMER_MODE_REL);
+    }
+}
+
+/* whether to hold this frame back, counting it towards the adaptive rate */
+static bool rpmsg_ether_coal_active(const struct rpmsg_ether_coal *coal,
+                                    struct rpmsg_ether_rate *rate)
+{
+    u64 now;
+
+    if (!READ_ONCE(coal->usecs))
+        return false;
+
+    if (!READ_ONCE(coal->adaptive))
+        return true;
+
+    now = ktime_get_ns();
+    rate->count++;
+
+    if (now - rate->start >= RPMSG_ETHER_ADAPT_NS)
+    {
+        rate->busy = rate->count > RPMSG_ETHER_ADAPT_PPS /
+                                   (NSEC_PER_SEC / RPMSG_ETHER_ADAPT_NS);
+        rate->start = now;
+        rate->count = 0;
+    }
+
+    return rate->busy;
+}
+
+/* the frame count is reached, or there is no count and the timer decides */
+static bool rpmsg_ether_coal_hold(const struct rpmsg_ether_coal *coal,
+                                  unsigned int queued)
+{
+    u32 frames = READ_ONCE(coal->frames);
+
+    return !frames || queued < frames;
+}
+
+static void rpmsg_ether_coal_arm(struct hrtimer *timer, const struct rpmsg_ether_coal *coal)
+{
+    if (!hrtimer_active(timer))
+        hrtimer_start(timer, ns_to_ktime((u64)READ_ONCE(coal->usecs) * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart rpmsg_ether_tx_coal_timeout(struct hrtimer *timer)
+{
+    struct rpmsg_ether_queue *q = container_of(timer, struct rpmsg_ether_queue,
+                                               tx_coal_timer);
+
+    queue_work(q->priv->tx_wq, &q->tx_work);
+
+    return HRTIMER_NORESTART;
+}
+
+static enum hrtimer_restart rpmsg_ether_rx_coal_timeout(struct hrtimer *timer)
+{
+    struct rpmsg_ether_queue *q = container_of(timer, struct rpmsg_ether_queue,
+                                               rx_coal_timer);
+
+    napi_schedule(&q->napi);
+
+    return HRTIMER_NORESTART;
+}
+
+/* hand a frame to the queue's worker, txq's xmit lock held */
+static void rpmsg_ether_tx_queue(struct rpmsg_ether_queue *q, struct netdev_queue *txq,
+                                 struct sk_buff *skb)
+{
+    netdev_tx_sent_queue(txq, skb->len);
+    skb_queue_tail(&q->tx_queue, skb);
+
+    if (skb_queue_len(&q->tx_queue) >= rpmsg_ether_tx_backlog())
+    {
+        netif_tx_stop_queue(txq);
+
+        /* the worker may have drained the queue before it saw the stop */
+        smp_mb();
+        if (skb_queue_len(&q->tx_queue) < rpmsg_ether_tx_backlog())
+            netif_tx_wake_queue(txq);
+    }
 
-    dev_kfree_skb_any(skb);
+    /* tx-usecs/tx-frames: wake the worker once for a batch, never for a stopped queue */
+    if (rpmsg_ether_coal_active(&q->priv->tx_coal, &q->tx_rate) &&
+        !netif_tx_queue_stopped(txq) &&
+        rpmsg_ether_coal_hold(&q->priv->tx_coal, skb_queue_len(&q->tx_queue)))
+        rpmsg_ether_coal_arm(&q->tx_coal_timer, &q->priv->tx_coal);
+    else
+        queue_work(q->priv->tx_wq, &q->tx_work);
+}
+
+/*
+ * The higher levels take care of making this non-reentrant per TX queue
+ * (it's called with bh's disabled and the queue's xmit lock held), and
+ * pick the queue by flow hash, so a flow always uses the same endpoint
+ * and stays in order.  Queue the frame for that queue's worker and stop
+ * the queue once ether_tx_backlog frames wait for the vring.
+ */
+static netdev_tx_t rpmsg_ether_xmit(struct sk_buff *skb,
+                            struct net_device *dev)
+{
+    struct _rpmsg_dev_params *priv = netdev_priv(dev);
+    u16 index = skb_get_queue_mapping(skb);
+    struct rpmsg_ether_queue *q = &priv->queues[index];
+    struct netdev_queue *txq = netdev_get_tx_queue(dev, index);
+
+    /* the MTU keeps us below this, never send a truncated frame */
+    if (skb->len > dev->mtu + dev->hard_header_len)
+    {
+        rpmsg_ether_stat_inc(q, tx_dropped);
+        rpmsg_ether_stat_inc(q, tx_oversize);
+        dev_kfree_skb_any(skb);
+        return NETDEV_TX_OK;
+    }
+
+    rpmsg_ether_tx_queue(q, txq, skb);
 
     return NETDEV_TX_OK;
 }
@@ -121,17 +891,93 @@ static void rpmsg_read_mac_addr(struct net_device *dev)
 
 static int rpmsg_ether_open(struct net_device *ndev)
 {
-    rpmsg_read_mac_addr(ndev);
-    netif_start_queue(ndev);
+    struct _rpmsg_dev_params *priv = netdev_priv(ndev);
+    int i;
+
+    if (!ether_raw_ip)
+        rpmsg_read_mac_addr(ndev);
+
+    for (i = 0; i < priv->num_queues; i++)
+    {
+        struct rpmsg_ether_queue *q = &priv->queues[i];
+
+        /* NAPI poll keeps it topped up from here on */
+        while (skb_queue_len(&q->rx_cache) < ether_rx_cache)
+        {
+            struct sk_buff *skb = netdev_alloc_skb_ip_align(ndev, ETHERNET_PDU_SIZE);
+
+            if (!skb)
+                break;
+            skb_queue_tail(&q->rx_cache, skb);
+        }
+
+        napi_enable(&q->napi);
+
+        if (ether_hdr_comp)
+        {
+            q->hc_req_at = jiffies;
+            rpmsg_ether_ctrl(q, RPMSG_ETHER_CTRL_HC_REQ, 0);
+        }
+    }
+
+    netif_tx_start_all_queues(ndev);
 
     return 0;
 }
 
 
+/* quiesce one queue pair, the TX queues are already stopped */
+static void rpmsg_ether_queue_stop(struct rpmsg_ether_queue *q)
+{
+    napi_disable(&q->napi);
+    hrtimer_cancel(&q->rx_coal_timer);
+    skb_queue_purge(&q->rx_queue);
+    skb_queue_purge(&q->rx_cache);
+
+    /* only xmit arms it, and the TX queues are stopped */
+    hrtimer_cancel(&q->tx_coal_timer);
+
+    /*
+     * The timer queues the worker and the worker arms the timer; after an
+     * expiry the worker flushes instead of re-arming, so twice is enough.
+     */
+    hrtimer_cancel(&q->aggr_timer);
+    cancel_work_sync(&q->tx_work);
+    hrtimer_cancel(&q->aggr_timer);
+    cancel_work_sync(&q->tx_work);
+    skb_queue_purge(&q->tx_queue);
+    netdev_tx_reset_queue(netdev_get_tx_queue(q->priv->dev, q->index));
+
+    /* packed frames that never went out */
+    rpmsg_ether_stat_add(q, tx_dropped, q->aggr_frames);
+    q->aggr_len = 0;
+    q->aggr_frames = 0;
+    q->aggr_bytes = 0;
+
+    del_timer_sync(&q->rx_frag_timer);
+    spin_lock_bh(&q->lock);
+    dev_kfree_skb_any(q->rx_frag_skb);
+    q->rx_frag_skb = NULL;
+    spin_unlock_bh(&q->lock);
+
+    /* negotiated again on the next open */
+    WRITE_ONCE(q->hc_tx_on, false);
+    memset(q->hc_tx, 0, sizeof(q->hc_tx));
+    memset(q->hc_rx, 0, sizeof(q->hc_rx));
+    bitmap_zero(q->hc_nack, RPMSG_ETHER_HC_CONTEXTS);
+}
+
 int rpmsg_ether_stop (struct net_device *dev)
 {
+    struct _rpmsg_dev_params *priv = netdev_priv(dev);
+    int i;
+
     pr_info ("stop called\n");
-    netif_stop_queue(dev);
+    netif_tx_stop_all_queues(dev);
+
+    for (i = 0; i < priv->num_queues; i++)
+        rpmsg_ether_queue_stop(&priv->queues[i]);
+
     return 0;
 }
 
@@ -150,10 +996,85 @@ int rpmsg_ether_config(struct net_device *dev, struct ifmap *map)
 
 
 
-struct net_device_stats *rpmsg_ether_stats(struct net_device *dev)
+/* add one queue's per-CPU counters to sum */
+static void rpmsg_ether_queue_stats_sum(struct rpmsg_ether_queue *q,
+                                        struct rpmsg_ether_pcpu_stats *sum)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct rpmsg_ether_pcpu_stats *st = per_cpu_ptr(q->pcpu_stats, cpu);
+        struct rpmsg_ether_pcpu_stats snap;
+        unsigned int start;
+
+        do
+        {
+            start = u64_stats_fetch_begin_irq(&st->syncp);
+            snap = *st;
+        }
+        while (u64_stats_fetch_retry_irq(&st->syncp, start));
+
+        sum->rx_packets       += snap.rx_packets;
+        sum->rx_bytes         += snap.rx_bytes;
+        sum->rx_dropped       += snap.rx_dropped;
+        sum->rx_length_errors += snap.rx_length_errors;
+        sum->rx_frame_errors  += snap.rx_frame_errors;
+        sum->tx_packets       += snap.tx_packets;
+        sum->tx_bytes         += snap.tx_bytes;
+        sum->tx_dropped       += snap.tx_dropped;
+        sum->tx_errors        += snap.tx_errors;
+        sum->tx_busy          += snap.tx_busy;
+        sum->tx_oversize      += snap.tx_oversize;
+        sum->tx_frags         += snap.tx_frags;
+        sum->tx_aggr          += snap.tx_aggr;
+        sum->rx_frags         += snap.rx_frags;
+        sum->rx_reasm         += snap.rx_reasm;
+        sum->rx_reasm_timeout += snap.rx_reasm_timeout;
+        sum->rx_aggr          += snap.rx_aggr;
+        sum->rx_cache_miss    += snap.rx_cache_miss;
+        sum->rx_alloc_fail    += snap.rx_alloc_fail;
+        sum->rx_xdp_drop      += snap.rx_xdp_drop;
+        sum->rx_xdp_tx        += snap.rx_xdp_tx;
+        sum->tx_hc            += snap.tx_hc;
+        sum->tx_hc_ctx        += snap.tx_hc_ctx;
+        sum->rx_hc            += snap.rx_hc;
+        sum->rx_hc_miss       += snap.rx_hc_miss;
+    }
+}
+
+/* sum every queue's counters into one snapshot */
+static void rpmsg_ether_stats_sum(struct _rpmsg_dev_params *priv,
+                                  struct rpmsg_ether_pcpu_stats *sum)
+{
+    int i;
+
+    memset(sum, 0, sizeof(*sum));
+
+    for (i = 0; i < priv->num_queues; i++)
+        rpmsg_ether_queue_stats_sum(&priv->queues[i], sum);
+}
+
+static struct rtnl_link_stats64 *rpmsg_ether_get_stats64(struct net_device *dev,
+                                                         struct rtnl_link_stats64 *stats)
 {
     struct _rpmsg_dev_params *priv = netdev_priv(dev);
-    return &priv->stats;
+    struct rpmsg_ether_pcpu_stats sum;
+
+    rpmsg_ether_stats_sum(priv, &sum);
+
+    stats->rx_packets       = sum.rx_packets;
+    stats->rx_bytes         = sum.rx_bytes;
+    stats->rx_dropped       = sum.rx_dropped;
+    stats->rx_length_errors = sum.rx_length_errors;
+    stats->rx_frame_errors  = sum.rx_frame_errors;
+    stats->rx_errors        = sum.rx_length_errors + sum.rx_frame_errors;
+    stats->tx_packets       = sum.tx_packets;
+    stats->tx_bytes         = sum.tx_bytes;
+    stats->tx_dropped       = sum.tx_dropped;
+    stats->tx_errors        = sum.tx_errors;
+
+    return stats;
 }
 
 
@@ -163,67 +1084,874 @@ static u32 always_on(struct net_device *dev)
 }
 
 
+/* ethtool -S, for what struct rtnl_link_stats64 has no field for */
+static const struct
+{
+    char name[ETH_GSTRING_LEN];
+    size_t offset;
+} rpmsg_ether_ethtool_stats[] = {
+    { "tx_busy",          offsetof(struct rpmsg_ether_pcpu_stats, tx_busy) },
+    { "tx_oversize",      offsetof(struct rpmsg_ether_pcpu_stats, tx_oversize) },
+    { "tx_frags",         offsetof(struct rpmsg_ether_pcpu_stats, tx_frags) },
+    { "tx_aggr",          offsetof(struct rpmsg_ether_pcpu_stats, tx_aggr) },
+    { "rx_frags",         offsetof(struct rpmsg_ether_pcpu_stats, rx_frags) },
+    { "rx_reasm",         offsetof(struct rpmsg_ether_pcpu_stats, rx_reasm) },
+    { "rx_reasm_timeout", offsetof(struct rpmsg_ether_pcpu_stats, rx_reasm_timeout) },
+    { "rx_aggr",          offsetof(struct rpmsg_ether_pcpu_stats, rx_aggr) },
+    { "rx_cache_miss",    offsetof(struct rpmsg_ether_pcpu_stats, rx_cache_miss) },
+    { "rx_alloc_fail",    offsetof(struct rpmsg_ether_pcpu_stats, rx_alloc_fail) },
+    { "rx_xdp_drop",      offsetof(struct rpmsg_ether_pcpu_stats, rx_xdp_drop) },
+    { "rx_xdp_tx",        offsetof(struct rpmsg_ether_pcpu_stats, rx_xdp_tx) },
+    { "tx_hc",            offsetof(struct rpmsg_ether_pcpu_stats, tx_hc) },
+    { "tx_hc_ctx",        offsetof(struct rpmsg_ether_pcpu_stats, tx_hc_ctx) },
+    { "rx_hc",            offsetof(struct rpmsg_ether_pcpu_stats, rx_hc) },
+    { "rx_hc_miss",       offsetof(struct rpmsg_ether_pcpu_stats, rx_hc_miss) },
+};
+
+/* then, per queue, how the flows spread over the endpoints */
+#define RPMSG_ETHER_QUEUE_STATS         4
+
+static int rpmsg_ether_get_sset_count(struct net_device *dev, int sset)
+{
+    struct _rpmsg_dev_params *priv = netdev_priv(dev);
+
+    if (sset != ETH_SS_STATS)
+        return -EOPNOTSUPP;
+
+    return ARRAY_SIZE(rpmsg_ether_ethtool_stats) +
+           priv->num_queues * RPMSG_ETHER_QUEUE_STATS;
+}
+
+static void rpmsg_ether_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+    struct _rpmsg_dev_params *priv = netdev_priv(dev);
+    int i;
+
+    if (sset != ETH_SS_STATS)
+        return;
+
+    for (i = 0; i < ARRAY_SIZE(rpmsg_ether_ethtool_stats); i++)
+    {
+        memcpy(data, rpmsg_ether_ethtool_stats[i].name, ETH_GSTRING_LEN);
+        data += ETH_GSTRING_LEN;
+    }
+
+    for (i = 0; i < priv->num_queues; i++)
+    {
+        snprintf(data, ETH_GSTRING_LEN, "rx%d_packets", i);
+        data += ETH_GSTRING_LEN;
+        snprintf(data, ETH_GSTRING_LEN, "rx%d_bytes", i);
+        data += ETH_GSTRING_LEN;
+        snprintf(data, ETH_GSTRING_LEN, "tx%d_packets", i);
+        data += ETH_GSTRING_LEN;
+        snprintf(data, ETH_GSTRING_LEN, "tx%d_bytes", i);
+        data += ETH_GSTRING_LEN;
+    }
+}
+
+static void rpmsg_ether_get_ethtool_stats(struct net_device *dev,
+                                          struct ethtool_stats *stats, u64 *data)
+{
+    struct _rpmsg_dev_params *priv = netdev_priv(dev);
+    struct rpmsg_ether_pcpu_stats sum;
+    int i;
+
+    rpmsg_ether_stats_sum(priv, &sum);
+
+    for (i = 0; i < ARRAY_SIZE(rpmsg_ether_ethtool_stats); i++)
+        *data++ = *(u64 *)((char *)&sum + rpmsg_ether_ethtool_stats[i].offset);
+
+    for (i = 0; i < priv->num_queues; i++)
+    {
+        memset(&sum, 0, sizeof(sum));
+        rpmsg_ether_queue_stats_sum(&priv->queues[i], &sum);
+
+        *data++ = sum.rx_packets;
+        *data++ = sum.rx_bytes;
+        *data++ = sum.tx_packets;
+        *data++ = sum.tx_bytes;
+    }
+}
+
+
+static int rpmsg_ether_get_coalesce(struct net_device *dev, struct ethtool_coalesce *ec)
+{
+    struct _rpmsg_dev_params *priv = netdev_priv(dev);
+
+    ec->rx_coalesce_usecs        = priv->rx_coal.usecs;
+    ec->rx_max_coalesced_frames  = priv->rx_coal.frames;
+    ec->use_adaptive_rx_coalesce = priv->rx_coal.adaptive;
+    ec->tx_coalesce_usecs        = priv->tx_coal.usecs;
+    ec->tx_max_coalesced_frames  = priv->tx_coal.frames;
+    ec->use_adaptive_tx_coalesce = priv->tx_coal.adaptive;
+
+    return 0;
+}
+
+/* frames alone would hold a lone frame forever, the timer bounds the wait */
+static int rpmsg_ether_coal_check(u32 usecs, u32 frames)
+{
+    if (usecs > RPMSG_ETHER_COAL_MAX_USECS || frames > RPMSG_ETHER_COAL_MAX_FRAMES)
+        return -EINVAL;
+
+    if (frames > 1 && !usecs)
+        return -EINVAL;
+
+    return 0;
+}
+
+/* takes effect from the next frame, a running timer keeps its expiry */
+static int rpmsg_ether_set_coalesce(struct net_device *dev, struct ethtool_coalesce *ec)
+{
+    struct _rpmsg_dev_params *priv = netdev_priv(dev);
+
+    if (rpmsg_ether_coal_check(ec->rx_coalesce_usecs, ec->rx_max_coalesced_frames) ||
+        rpmsg_ether_coal_check(ec->tx_coalesce_usecs, ec->tx_max_coalesced_frames))
+        return -EINVAL;
+
+    WRITE_ONCE(priv->rx_coal.usecs, ec->rx_coalesce_usecs);
+    WRITE_ONCE(priv->rx_coal.frames, ec->rx_max_coalesced_frames);
+    WRITE_ONCE(priv->rx_coal.adaptive, !!ec->use_adaptive_rx_coalesce);
+    WRITE_ONCE(priv->tx_coal.usecs, ec->tx_coalesce_usecs);
+    WRITE_ONCE(priv->tx_coal.frames, ec->tx_max_coalesced_frames);
+    WRITE_ONCE(priv->tx_coal.adaptive, !!ec->use_adaptive_tx_coalesce);
+
+    return 0;
+}
+
+
 static const struct ethtool_ops rpmsg_ethtool_ops = {
     .get_link           = always_on,
+    .get_sset_count     = rpmsg_ether_get_sset_count,
+    .get_strings        = rpmsg_ether_get_strings,
+    .get_ethtool_stats  = rpmsg_ether_get_ethtool_stats,
+    .get_coalesce       = rpmsg_ether_get_coalesce,
+    .set_coalesce       = rpmsg_ether_set_coalesce,
 };
 
 
 
+static int rpmsg_ether_change_mtu(struct net_device *dev, int new_mtu)
+{
+    int max_mtu = ether_link_frag ? RPMSG_ETHER_LINK_MAX_MTU :
+                  ether_raw_ip ? RAW_IP_MTU_SIZE : ETHERNET_MTU_SIZE;
+
+    /* without framing a frame has to fit one rpmsg buffer */
+    if (new_mtu < 68 || new_mtu > max_mtu)
+        return -EINVAL;
+
+    dev->mtu = new_mtu;
+    return 0;
+}
+
+
+/* a raw-IP interface has no address to validate */
+static int rpmsg_ether_validate_addr(struct net_device *dev)
+{
+    return ether_raw_ip ? 0 : eth_validate_addr(dev);
+}
+
+
+#ifdef RPMSG_ETHER_XDP
+/* XDP_SETUP_PROG: the core passes us its reference on prog */
+static int rpmsg_ether_xdp_set(struct net_device *dev, struct bpf_prog *prog)
+{
+    struct _rpmsg_dev_params *priv = netdev_priv(dev);
+    struct bpf_prog *old = rtnl_dereference(priv->xdp_prog);
+
+    rcu_assign_pointer(priv->xdp_prog, prog);
+
+    /* freed after a grace period, a callback may still be running it */
+    if (old)
+        bpf_prog_put(old);
+
+    return 0;
+}
+
+static int rpmsg_ether_xdp(struct net_device *dev, struct netdev_xdp *xdp)
+{
+    struct _rpmsg_dev_params *priv = netdev_priv(dev);
+
+    switch (xdp->command)
+    {
+    case XDP_SETUP_PROG:
+        return rpmsg_ether_xdp_set(dev, xdp->prog);
+    case XDP_QUERY_PROG:
+        xdp->prog_attached = !!rtnl_dereference(priv->xdp_prog);
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+#endif
+
+
 static const struct net_device_ops rpmsg_netdev_ops = {
     .ndo_open           = rpmsg_ether_open,
     .ndo_stop           = rpmsg_ether_stop,
     .ndo_start_xmit     = rpmsg_ether_xmit,
     .ndo_set_config     = rpmsg_ether_config,
-    .ndo_validate_addr  = eth_validate_addr,
-    .ndo_get_stats      = rpmsg_ether_stats,
+    .ndo_validate_addr  = rpmsg_ether_validate_addr,
+    .ndo_get_stats64    = rpmsg_ether_get_stats64,
+    .ndo_change_mtu     = rpmsg_ether_change_mtu,
+#ifdef RPMSG_ETHER_XDP
+    .ndo_xdp            = rpmsg_ether_xdp,
+#endif
 
 };
 
 
-static void rpmsg_ethernet_dev_ept_cb(struct rpmsg_channel *rpdev, void *data,
-                                        int len, void *priv, u32 src)
+/*
+ * A receive skb for len bytes.  Up to one PDU they come out of rx_cache,
+ * so the callback normally never enters the allocator; larger frames
+ * (reassembly) and an empty cache fall back to netdev_alloc_skb().
+ */
+static struct sk_buff *rpmsg_ether_rx_alloc(struct rpmsg_ether_queue *q,
+                                            unsigned int len)
 {
+    struct sk_buff *skb = NULL;
 
-        struct _rpmsg_dev_params *local = dev_get_drvdata(&rpdev->dev);
-        struct sk_buff *skb;
-        
-        spin_lock_bh(&local->lock);
+    if (len <= ETHERNET_PDU_SIZE)
+    {
+        skb = skb_dequeue(&q->rx_cache);
+        if (skb)
+            return skb;
+        rpmsg_ether_stat_inc(q, rx_cache_miss);
+    }
+
+    skb = netdev_alloc_skb_ip_align(q->priv->dev, len);
+    if (!skb)
+        rpmsg_ether_stat_inc(q, rx_alloc_fail);
+
+    return skb;
+}
+
+/* top rx_cache up from NAPI context, where napi_alloc_skb() is cheapest */
+static void rpmsg_ether_rx_refill(struct rpmsg_ether_queue *q)
+{
+    while (skb_queue_len(&q->rx_cache) < ether_rx_cache)
+    {
+        struct sk_buff *skb = napi_alloc_skb(&q->napi, ETHERNET_PDU_SIZE);
+
+        if (!skb)
+        {
+            rpmsg_ether_stat_inc(q, rx_alloc_fail);
+            break;
+        }
+        skb_queue_tail(&q->rx_cache, skb);
+    }
+}
+
+/*
+ * NAPI poll: hand up to budget queued frames to GRO.  The callback keeps
+ * queueing while we are scheduled, so a burst from the M4 costs one
+ * softirq instead of one per frame.
+ */
+static int rpmsg_ether_poll(struct napi_struct *napi, int budget)
+{
+    struct rpmsg_ether_queue *q = container_of(napi, struct rpmsg_ether_queue, napi);
+    struct rpmsg_ether_pcpu_stats *st;
+    struct sk_buff *skb;
+    unsigned int bytes = 0;
+    int done = 0;
+
+    while (done < budget && (skb = skb_dequeue(&q->rx_queue)) != NULL)
+    {
+        bytes += skb->len;
+        napi_gro_receive(napi, skb);
+        done++;
+    }
+
+    /* softirq, no need for rpmsg_ether_stat_add()'s bh dance */
+    st = this_cpu_ptr(q->pcpu_stats);
+    u64_stats_update_begin(&st->syncp);
+    st->rx_packets += done;
+    st->rx_bytes += bytes;
+    u64_stats_update_end(&st->syncp);
+
+    rpmsg_ether_rx_refill(q);
+
+    if (done < budget)
+    {
+        napi_complete_done(napi, done);
+
+        /* queued after our last dequeue, napi_schedule() saw us still running */
+        if (!skb_queue_empty(&q->rx_queue))
+            napi_schedule(napi);
+    }
+
+    return done;
+}
+
+/* hand a complete frame to NAPI, consumes skb */
+static void rpmsg_ether_rx_deliver(struct rpmsg_ether_queue *q, struct sk_buff *skb)
+{
+    if (ether_raw_ip)
+    {
+        /* no link header, the IP version nibble tells the protocol */
+        switch (skb->len ? skb->data[0] >> 4 : 0)
+        {
+        case 4:
+            skb->protocol = htons(ETH_P_IP);
+            break;
+        case 6:
+            skb->protocol = htons(ETH_P_IPV6);
+            break;
+        default:
+            dev_kfree_skb_any(skb);
+            rpmsg_ether_stat_inc(q, rx_frame_errors);
+            rpmsg_ether_stat_inc(q, rx_dropped);
+            atomic64_inc(&q->ept_stats.drops);
+            return;
+        }
+        skb_reset_mac_header(skb);
+        skb->pkt_type = PACKET_HOST;
+    }
+    else
+    {
+        skb->protocol = eth_type_trans(skb, q->priv->dev);
+    }
+    skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
+    skb_record_rx_queue(skb, q->index);
+    skb_queue_tail(&q->rx_queue, skb);
+    rpmsg_neo_stats_queue(&q->ept_stats, skb_queue_len(&q->rx_queue));
+
+    /* rx-usecs/rx-frames: one poll for a batch instead of one per frame */
+    if (rpmsg_ether_coal_active(&q->priv->rx_coal, &q->rx_rate) &&
+        rpmsg_ether_coal_hold(&q->priv->rx_coal, skb_queue_len(&q->rx_queue)))
+    {
+        rpmsg_ether_coal_arm(&q->rx_coal_timer, &q->priv->rx_coal);
+        return;
+    }
+
+    /* we run in process context, let the softirq run on bh enable */
+    local_bh_disable();
+    napi_schedule(&q->napi);
+    local_bh_enable();
+}
+
+/* what becomes of a received frame, XDP_* folded into what we act on */
+enum rpmsg_ether_rx_act
+{
+    RPMSG_ETHER_RX_PASS,
+    RPMSG_ETHER_RX_TX,
+    RPMSG_ETHER_RX_DROP,
+};
+
+#ifdef RPMSG_ETHER_XDP
+/*
+ * Run the XDP program, if one is attached, on a complete frame where it
+ * lies: the rpmsg buffer itself, before any skb exists.  The callback
+ * runs in process context, so bh is disabled around the program for
+ * per-CPU maps.  On PASS and TX *data and *len describe what the
+ * program left of the frame.
+ */
+static enum rpmsg_ether_rx_act rpmsg_ether_rx_xdp(struct rpmsg_ether_queue *q,
+                                                  void **data, unsigned int *len)
+{
+    struct bpf_prog *prog;
+    struct xdp_buff xdp;
+    u32 act = XDP_PASS;
+
+    if (!rcu_access_pointer(q->priv->xdp_prog))
+        return RPMSG_ETHER_RX_PASS;
+
+    local_bh_disable();
+    rcu_read_lock();
+    prog = rcu_dereference(q->priv->xdp_prog);
+    if (prog)
+    {
+        /* no headroom in front of the frame, bpf_xdp_adjust_head() can only shrink it */
+        xdp.data_hard_start = *data;
+        xdp.data = *data;
+        xdp.data_end = *data + *len;
+
+        act = bpf_prog_run_xdp(prog, &xdp);
+
+        *data = xdp.data;
+        *len = xdp.data_end - xdp.data;
+    }
+    rcu_read_unlock();
+    local_bh_enable();
+
+    switch (act)
+    {
+    case XDP_PASS:
+        return RPMSG_ETHER_RX_PASS;
+    case XDP_TX:
+        rpmsg_ether_stat_inc(q, rx_xdp_tx);
+        return RPMSG_ETHER_RX_TX;
+    default:
+        bpf_warn_invalid_xdp_action(act);
+        /* fall through */
+    case XDP_ABORTED:
+    case XDP_DROP:
+        rpmsg_ether_stat_inc(q, rx_xdp_drop);
+        return RPMSG_ETHER_RX_DROP;
+    }
+}
+#else
+/* no ndo_xdp before 4.10, every frame goes up the stack */
+static inline enum rpmsg_ether_rx_act rpmsg_ether_rx_xdp(struct rpmsg_ether_queue *q,
+                                                         void **data, unsigned int *len)
+{
+    return RPMSG_ETHER_RX_PASS;
+}
+#endif
+
+/*
+ * RPMSG_ETHER_RX_TX: send the frame back out of the queue it came in on.  It has to
+ * go through the worker, which owns tx_buff and keeps fragment runs
+ * whole, so unlike xmit nothing waits for a stopped queue: the frame is
+ * dropped instead.
+ */
+static void rpmsg_ether_xdp_tx(struct rpmsg_ether_queue *q, struct sk_buff *skb)
+{
+    struct netdev_queue *txq = netdev_get_tx_queue(q->priv->dev, q->index);
+
+    __netif_tx_lock_bh(txq);
+    if (netif_xmit_frozen_or_stopped(txq))
+    {
+        __netif_tx_unlock_bh(txq);
+        rpmsg_ether_stat_inc(q, tx_dropped);
+        dev_kfree_skb_any(skb);
+        return;
+    }
+    rpmsg_ether_tx_queue(q, txq, skb);
+    __netif_tx_unlock_bh(txq);
+}
+
+/* a complete frame still in the rpmsg buffer: XDP, then an skb only if needed */
+static void rpmsg_ether_rx_frame(struct rpmsg_ether_queue *q, void *data, unsigned int len)
+{
+    struct sk_buff *skb;
+    enum rpmsg_ether_rx_act act = rpmsg_ether_rx_xdp(q, &data, &len);
+
+    if (act == RPMSG_ETHER_RX_DROP)
+        return;
+
+    skb = rpmsg_ether_rx_alloc(q, len);
+    if (!skb)
+    {
+        rpmsg_ether_stat_inc(q, rx_dropped);
+        atomic64_inc(&q->ept_stats.drops);
+        return;
+    }
+
+    memcpy(skb_put(skb, len), data, len);
+
+    if (act == RPMSG_ETHER_RX_TX)
+        rpmsg_ether_xdp_tx(q, skb);
+    else
+        rpmsg_ether_rx_deliver(q, skb);
+}
+
+/* a reassembled frame is in an skb already, XDP runs on its data */
+static void rpmsg_ether_rx_skb(struct rpmsg_ether_queue *q, struct sk_buff *skb)
+{
+    void *data = skb->data;
+    unsigned int len = skb->len;
+    enum rpmsg_ether_rx_act act = rpmsg_ether_rx_xdp(q, &data, &len);
+
+    if (act == RPMSG_ETHER_RX_DROP)
+    {
+        dev_kfree_skb_any(skb);
+        return;
+    }
+
+    skb_pull(skb, data - (void *)skb->data);
+    skb_trim(skb, len);
+
+    if (act == RPMSG_ETHER_RX_TX)
+        rpmsg_ether_xdp_tx(q, skb);
+    else
+        rpmsg_ether_rx_deliver(q, skb);
+}
+
+/* lock held: give up on the frame being reassembled */
+static void rpmsg_ether_rx_frag_drop(struct rpmsg_ether_queue *q)
+{
+    if (!q->rx_frag_skb)
+        return;
+
+    dev_kfree_skb_any(q->rx_frag_skb);
+    q->rx_frag_skb = NULL;
+    rpmsg_ether_stat_inc(q, rx_frame_errors);
+    rpmsg_ether_stat_inc(q, rx_dropped);
+    atomic64_inc(&q->ept_stats.drops);
+}
+
+/* unpack a RPMSG_ETHER_LINK_AGGR buffer */
+static void rpmsg_ether_rx_aggr(struct rpmsg_ether_queue *q,
+                                struct rpmsg_ether_link_hdr *hdr, int len)
+{
+    u8 *rec = (u8 *)(hdr + 1);
+    u8 *end = (u8 *)hdr + len;
+
+    rpmsg_ether_stat_inc(q, rx_aggr);
+
+    while (end - rec >= sizeof(__le16))
+    {
+        unsigned int rec_len = get_unaligned_le16(rec);
+
+        rec += sizeof(__le16);
+        if (!rec_len)
+            break;
+
+        if (rec_len > end - rec)
+        {
+            rpmsg_ether_stat_inc(q, rx_length_errors);
+            rpmsg_ether_stat_inc(q, rx_dropped);
+            atomic64_inc(&q->ept_stats.drops);
+            break;
+        }
+
+        rpmsg_ether_rx_frame(q, rec, rec_len);
+
+        rec += rec_len;
+    }
+}
+
+/* the rest of a partly received frame never came */
+static void rpmsg_ether_rx_frag_timeout(unsigned long data)
+{
+    struct rpmsg_ether_queue *q = (struct rpmsg_ether_queue *)data;
+
+    spin_lock_bh(&q->lock);
+    if (q->rx_frag_skb)
+        rpmsg_ether_stat_inc(q, rx_reasm_timeout);
+    rpmsg_ether_rx_frag_drop(q);
+    spin_unlock_bh(&q->lock);
+}
+
+/*
+ * One link fragment.  Fragments of a frame arrive in order on the vring,
+ * so any gap in id or frag means some were lost: the partial frame is
+ * dropped, and so is a run whose first fragment we never saw.
+ */
+static void rpmsg_ether_rx_frag(struct rpmsg_ether_queue *q,
+                                struct rpmsg_ether_link_hdr *hdr, int len)
+{
+    struct net_device *dev = q->priv->dev;
+    struct sk_buff *skb = NULL;
+    u16 id = le16_to_cpu(hdr->id);
+
+    len -= sizeof(*hdr);
+    rpmsg_ether_stat_inc(q, rx_frags);
+
+    spin_lock_bh(&q->lock);
+
+    if (q->rx_frag_skb &&
+        (id != q->rx_frag_id || hdr->frag != q->rx_frag_next))
+        rpmsg_ether_rx_frag_drop(q);
+
+    if (!q->rx_frag_skb)
+    {
+        if (hdr->frag != 0)
+        {
+            rpmsg_ether_stat_inc(q, rx_frame_errors);
+            goto drop;
+        }
+
+        /* whole frame in one fragment: no reassembly needed */
+        if (hdr->type == RPMSG_ETHER_LINK_FRAG_END)
+        {
+            spin_unlock_bh(&q->lock);
+
+            rpmsg_ether_rx_frame(q, hdr + 1, len);
+            return;
+        }
+
+        q->rx_frag_skb = rpmsg_ether_rx_alloc(q, dev->mtu + dev->hard_header_len);
+        if (!q->rx_frag_skb)
+            goto drop;
+
+        q->rx_frag_id = id;
+        q->rx_frag_next = 0;
+        mod_timer(&q->rx_frag_timer,
+                  jiffies + msecs_to_jiffies(ether_frag_timeout_ms));
+    }
+
+    if (len > skb_tailroom(q->rx_frag_skb))
+    {
+        /* larger than our MTU */
+        rpmsg_ether_stat_inc(q, rx_length_errors);
+        rpmsg_ether_rx_frag_drop(q);
+        spin_unlock_bh(&q->lock);
+        return;
+    }
+
+    memcpy(skb_put(q->rx_frag_skb, len), hdr + 1, len);
+    q->rx_frag_next++;
+
+    if (hdr->type == RPMSG_ETHER_LINK_FRAG_END)
+    {
+        skb = q->rx_frag_skb;
+        q->rx_frag_skb = NULL;
+        del_timer(&q->rx_frag_timer);
+        rpmsg_ether_stat_inc(q, rx_reasm);
+    }
+
+    spin_unlock_bh(&q->lock);
 
-        skb= dev_alloc_skb(len);
-      
-        skb_reserve(skb, 2); /* align IP on 16B boundary */  
-        memcpy(skb_put(skb, len), data, len);
+    if (skb)
+        rpmsg_ether_rx_skb(q, skb);
 
-        skb->dev = rpmsg_netdev;
-        skb->protocol = eth_type_trans(skb, rpmsg_netdev);
-        skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
-        local->stats.rx_packets++;
-        local->stats.rx_bytes += len;
-        netif_rx(skb);
-       spin_unlock_bh(&local->lock);
+    return;
 
+drop:
+    spin_unlock_bh(&q->lock);
+    rpmsg_ether_stat_inc(q, rx_dropped);
+    atomic64_inc(&q->ept_stats.drops);
+}
+
+/* RPMSG_ETHER_LINK_CTRL */
+static void rpmsg_ether_hc_rx_ctrl(struct rpmsg_ether_queue *q, u8 op, u16 arg)
+{
+    int i;
+
+    switch (op)
+    {
+    case RPMSG_ETHER_CTRL_HC_REQ:
+        /* the peer (re)started: it has none of our contexts, we need none of its */
+        memset(q->hc_rx, 0, sizeof(q->hc_rx));
+        for (i = 0; i < RPMSG_ETHER_HC_CONTEXTS; i++)
+            set_bit(i, q->hc_nack);
+        WRITE_ONCE(q->hc_tx_on, true);
+        rpmsg_ether_ctrl(q, RPMSG_ETHER_CTRL_HC_ACK, 0);
+        break;
+    case RPMSG_ETHER_CTRL_HC_ACK:
+        WRITE_ONCE(q->hc_tx_on, true);
+        break;
+    case RPMSG_ETHER_CTRL_HC_NACK:
+        if (arg < RPMSG_ETHER_HC_CONTEXTS)
+            set_bit(arg, q->hc_nack);
+        break;
+    }
+}
+
+/* RPMSG_ETHER_LINK_HC_CTX, false if it does not describe an IPv4/TCP header */
+static bool rpmsg_ether_hc_rx_ctx(struct rpmsg_ether_queue *q, u8 cid, u8 *body, int len)
+{
+    unsigned int l2 = ether_raw_ip ? 0 : ETH_HLEN;
+    struct rpmsg_ether_hc_ctx *ctx;
+    struct iphdr *iph;
+
+    if (cid >= RPMSG_ETHER_HC_CONTEXTS || len < 2 || body[1] > len - 2 ||
+        body[1] > RPMSG_ETHER_HC_HDR_MAX || body[1] < l2 + sizeof(*iph) + sizeof(struct tcphdr))
+        return false;
+
+    iph = (struct iphdr *)(body + 2 + l2);
+    if (iph->ihl < 5 || l2 + iph->ihl * 4 + sizeof(struct tcphdr) != body[1])
+        return false;
+
+    ctx = &q->hc_rx[cid];
+    ctx->gen = body[0];
+    ctx->len = body[1];
+    memcpy(ctx->hdr, body + 2, ctx->len);
+    ctx->valid = true;
+
+    return true;
+}
+
+/* RPMSG_ETHER_LINK_HC: rebuild the full headers in front of options and payload */
+static void rpmsg_ether_hc_rx_frame(struct rpmsg_ether_queue *q, u8 cid, u8 *body, int len)
+{
+    struct rpmsg_ether_hc_hdr *hc = (struct rpmsg_ether_hc_hdr *)body;
+    unsigned int l2 = ether_raw_ip ? 0 : ETH_HLEN;
+    struct rpmsg_ether_hc_ctx *ctx;
+    unsigned int frame_len;
+    struct sk_buff *skb;
+    struct iphdr *iph;
+    struct tcphdr *th;
+    u8 *p;
+
+    if (cid >= RPMSG_ETHER_HC_CONTEXTS || len < sizeof(*hc))
+    {
+        rpmsg_ether_stat_inc(q, rx_length_errors);
+        goto drop;
+    }
+
+    ctx = &q->hc_rx[cid];
+    if (!ctx->valid || ctx->gen != hc->gen)
+    {
+        /* the context never came, or this segment predates the current one */
+        rpmsg_ether_stat_inc(q, rx_hc_miss);
+        rpmsg_ether_ctrl(q, RPMSG_ETHER_CTRL_HC_NACK, cid);
+        goto drop;
+    }
+
+    iph = (struct iphdr *)(ctx->hdr + l2);
+    th = (struct tcphdr *)((u8 *)iph + iph->ihl * 4);
+    if (len - sizeof(*hc) < th->doff * 4 - sizeof(*th))
+    {
+        rpmsg_ether_stat_inc(q, rx_length_errors);
+        goto drop;
+    }
+
+    frame_len = ctx->len + len - sizeof(*hc);
+    skb = rpmsg_ether_rx_alloc(q, frame_len);
+    if (!skb)
+        goto drop;
+
+    p = skb_put(skb, frame_len);
+    memcpy(p, ctx->hdr, ctx->len);
+    memcpy(p + ctx->len, hc + 1, len - sizeof(*hc));
+
+    iph = (struct iphdr *)(p + l2);
+    iph->tot_len = htons(frame_len - l2);
+    iph->id = hc->ip_id;
+    iph->check = ip_fast_csum((u8 *)iph, iph->ihl);
+
+    th = (struct tcphdr *)((u8 *)iph + iph->ihl * 4);
+    th->seq = hc->seq;
+    th->ack_seq = hc->ack_seq;
+    RPMSG_ETHER_TCP_FLAGS(th) = hc->flags;
+    th->window = hc->window;
+    th->check = hc->check;
+
+    rpmsg_ether_stat_inc(q, rx_hc);
+    rpmsg_ether_rx_skb(q, skb);
+    return;
+
+drop:
+    rpmsg_ether_stat_inc(q, rx_dropped);
+    atomic64_inc(&q->ept_stats.drops);
+}
+
+static void rpmsg_ethernet_dev_ept_cb(struct rpmsg_channel *rpdev, void *data,
+                                        int len, void *priv, u32 src)
+{
+
+        struct rpmsg_ether_queue *q = priv;
+        struct rpmsg_ether_link_hdr *hdr = data;
+        
+        rpmsg_neo_stats_rx(&q->ept_stats, len);
+        trace_rpmsg_neo_ether_rx(q->endpt, src, len,
+                                 skb_queue_len(&q->rx_queue));
+
+        if (!netif_running(q->priv->dev) ||
+            skb_queue_len(&q->rx_queue) >= ether_rx_backlog)
+            goto drop;
+
+        if (ether_link_frag)
+        {
+            if (len < sizeof(*hdr))
+            {
+                rpmsg_ether_stat_inc(q, rx_length_errors);
+                goto drop;
+            }
+
+            switch (hdr->type)
+            {
+            case RPMSG_ETHER_LINK_FRAG_MORE:
+            case RPMSG_ETHER_LINK_FRAG_END:
+                rpmsg_ether_rx_frag(q, hdr, len);
+                return;
+            case RPMSG_ETHER_LINK_AGGR:
+                rpmsg_ether_rx_aggr(q, hdr, len);
+                return;
+            case RPMSG_ETHER_LINK_CTRL:
+                if (!ether_hdr_comp)
+                    return;     /* leaves the peer on full headers */
+                rpmsg_ether_hc_rx_ctrl(q, hdr->frag, le16_to_cpu(hdr->id));
+                return;
+            case RPMSG_ETHER_LINK_HC_CTX:
+                if (ether_hdr_comp &&
+                    rpmsg_ether_hc_rx_ctx(q, hdr->frag, (u8 *)(hdr + 1), len - sizeof(*hdr)))
+                    return;
+                break;
+            case RPMSG_ETHER_LINK_HC:
+                if (!ether_hdr_comp)
+                    break;
+                rpmsg_ether_hc_rx_frame(q, hdr->frag, (u8 *)(hdr + 1), len - sizeof(*hdr));
+                return;
+            }
+
+            rpmsg_ether_stat_inc(q, rx_frame_errors);
+            goto drop;
+        }
+
+        rpmsg_ether_rx_frame(q, data, len);
 
         return;
+
+drop:
+        rpmsg_ether_stat_inc(q, rx_dropped);
+        atomic64_inc(&q->ept_stats.drops);
 }
 
 
 static int rpmsg_neo_ethernet_remove(void )
 {
+    struct _rpmsg_dev_params *priv = netdev_priv(rpmsg_netdev);
+    int i;
+
+    for (i = 0; i < priv->num_queues; i++)
+    {
+        rpmsg_neo_stats_unregister(&priv->queues[i].ept_stats);
+        hrtimer_cancel(&priv->queues[i].rx_coal_timer);
+        hrtimer_cancel(&priv->queues[i].tx_coal_timer);
+        hrtimer_cancel(&priv->queues[i].aggr_timer);
+    }
+    if (priv->tx_wq)
+        destroy_workqueue(priv->tx_wq);
+    priv->tx_wq = NULL;
  //FIX up   unregister_rpmsg_driver(&rpmsg_ethernet_dev_drv);
+    return 0;
+}
+
+/* everything but the endpoint, which is created once all queues exist */
+static int rpmsg_ether_queue_init(struct _rpmsg_dev_params *priv, int index)
+{
+    struct rpmsg_ether_queue *q = &priv->queues[index];
+
+    q->priv = priv;
+    q->index = index;
+    q->endpt = ETHERNET_ENDPOINT - index;
+
+    /* queue 0 keeps the name it had before there were more */
+    if (index)
+        snprintf(q->name, sizeof(q->name), "rpmsg_ether%d", index);
+    else
+        strlcpy(q->name, "rpmsg_ether", sizeof(q->name));
+
+    spin_lock_init(&q->lock);
+    skb_queue_head_init(&q->rx_queue);
+    skb_queue_head_init(&q->rx_cache);
+    skb_queue_head_init(&q->tx_queue);
+    setup_timer(&q->rx_frag_timer, rpmsg_ether_rx_frag_timeout, (unsigned long)q);
+    hrtimer_init(&q->aggr_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    q->aggr_timer.function = rpmsg_ether_aggr_timeout;
+    hrtimer_init(&q->rx_coal_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    q->rx_coal_timer.function = rpmsg_ether_rx_coal_timeout;
+    hrtimer_init(&q->tx_coal_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    q->tx_coal_timer.function = rpmsg_ether_tx_coal_timeout;
+    INIT_WORK(&q->tx_work, rpmsg_ether_tx_work);
+
+    q->pcpu_stats = netdev_alloc_pcpu_stats(struct rpmsg_ether_pcpu_stats);
+    if (!q->pcpu_stats)
+        return -ENOMEM;
+
+    netif_napi_add(priv->dev, &q->napi, rpmsg_ether_poll, NAPI_POLL_WEIGHT);
+
+    return 0;
 }
 
 int rpmsg_neo_ethernet(struct rpmsg_channel *rpmsg_chnl,
                        rpmsg_neo_remove_t *remove_func  )
 {
 
-    int result, ret = -ENOMEM;
+    int i, ret = -ENOMEM;
+    unsigned int num_queues = clamp_t(unsigned int, ether_queues, 1, RPMSG_ETHER_MAX_QUEUES);
     struct _rpmsg_dev_params *priv;
     
     pr_info("INFO:%s %d\n", __FUNCTION__, __LINE__);
     
     *remove_func = rpmsg_neo_ethernet_remove;
 
-    rpmsg_netdev = alloc_etherdev(sizeof(struct _rpmsg_dev_params));
+    /* the stack hashes each flow onto one of the TX queues */
+    rpmsg_netdev = alloc_etherdev_mq(sizeof(struct _rpmsg_dev_params), num_queues);
     if (rpmsg_netdev ==NULL) {
         pr_err("ERROR: %s %s %d\n", __FILE__, __FUNCTION__, __LINE__);
         return ret;
@@ -233,6 +1961,32 @@ int rpmsg_neo_ethernet(struct rpmsg_channel *rpmsg_chnl,
     rpmsg_netdev->netdev_ops = &rpmsg_netdev_ops;
     rpmsg_netdev->mtu            = ETHERNET_MTU_SIZE;
 
+    /* every path copies into a TX buffer anyway, let it gather and checksum */
+    rpmsg_netdev->hw_features    = NETIF_F_SG | NETIF_F_HW_CSUM | NETIF_F_HIGHDMA;
+    rpmsg_netdev->features      |= rpmsg_netdev->hw_features;
+
+    if (ether_raw_ip)
+    {
+        /* tun style: the M4 end has to be in raw-IP mode as well */
+        rpmsg_netdev->header_ops      = NULL;
+        rpmsg_netdev->type            = ARPHRD_NONE;
+        rpmsg_netdev->hard_header_len = 0;
+        rpmsg_netdev->addr_len        = 0;
+        rpmsg_netdev->flags           = IFF_POINTOPOINT | IFF_NOARP | IFF_MULTICAST;
+        rpmsg_netdev->mtu             = RAW_IP_MTU_SIZE;
+    }
+
+    /* aggregated buffers and compressed headers carry the link header */
+    if (ether_aggr || ether_hdr_comp)
+        ether_link_frag = true;
+
+    if (ether_link_frag)
+        rpmsg_netdev->mtu = RPMSG_ETHER_LINK_MTU;
+
+    /* full sized segments compress into one rpmsg */
+    if (ether_hdr_comp)
+        rpmsg_netdev->mtu = RPMSG_ETHER_HC_MTU;
+
     priv = netdev_priv(rpmsg_netdev);
     memset(priv, 0, sizeof(*priv));
 
@@ -244,40 +1998,69 @@ int rpmsg_neo_ethernet(struct rpmsg_channel *rpmsg_chnl,
 
   // call 
     priv->rpmsg_chnl = rpmsg_chnl;
-    priv->endpt = ETHERNET_ENDPOINT;
-    
-   spin_lock_init(&priv->lock);
 
-    
-    priv->ept = rpmsg_create_ept(priv->rpmsg_chnl,
-                                 rpmsg_ethernet_dev_ept_cb,
-                                  priv,
-                                  priv->endpt);
+    /* unbound: each queue's worker may run on its own core */
+    priv->tx_wq = alloc_workqueue("rpmsg_ether_tx", WQ_UNBOUND, 0);
+    if (!priv->tx_wq)
+    {
+        pr_err("ERROR: %s %d Failed to allocate TX workqueue.\n",  __FUNCTION__, __LINE__);
+        free_netdev(rpmsg_netdev);
+        return -ENOMEM;
+    }
 
+    for (priv->num_queues = 0; priv->num_queues < num_queues; priv->num_queues++)
+    {
+        if (rpmsg_ether_queue_init(priv, priv->num_queues))
+        {
+            pr_err("ERROR: %s %d Failed to allocate statistics.\n",  __FUNCTION__, __LINE__);
+            goto out;
+        }
+    }
 
-    if (!priv->ept)
+    for (i = 0; i < priv->num_queues; i++)
     {
-      pr_err("ERROR: %s %d Failed to create endpoint.\n",  __FUNCTION__, __LINE__);
-        goto out;
+        struct rpmsg_ether_queue *q = &priv->queues[i];
+
+        q->ept = rpmsg_create_ept(priv->rpmsg_chnl,
+                                  rpmsg_ethernet_dev_ept_cb,
+                                  q,
+                                  q->endpt);
+        if (!q->ept)
+        {
+            pr_err("ERROR: %s %d Failed to create endpoint %d.\n",  __FUNCTION__, __LINE__, q->endpt);
+            ret = -ENODEV;
+            goto out;
+        }
     }
 
-    result = register_netdev(rpmsg_netdev);
-    if (result) {
+    ret = register_netdev(rpmsg_netdev);
+    if (ret) {
         pr_err("ERROR: %s %s %d\n", __FILE__, __FUNCTION__, __LINE__);
-
-    } else {
-           
-        ret = 0;
-        pr_info("INFO: %s %s %d\n", __FILE__, __FUNCTION__, __LINE__);
+        goto out;
     }
 
+    for (i = 0; i < priv->num_queues; i++)
+        rpmsg_neo_stats_register(&priv->queues[i].ept_stats, priv->queues[i].name);
+
+    pr_info("INFO: %s %s %d %u queue(s), endpt %d..%d\n", __FILE__, __FUNCTION__, __LINE__,
+            priv->num_queues, ETHERNET_ENDPOINT - (int)priv->num_queues + 1, ETHERNET_ENDPOINT);
+
     return 0;
 
 out:
-    if(rpmsg_netdev) {
-        pr_err("ERROR: %s %s %d\n", __FILE__, __FUNCTION__, __LINE__);
-        return -1;
+    for (i = 0; i < num_queues; i++)
+    {
+        struct rpmsg_ether_queue *q = &priv->queues[i];
+
+        if (q->ept)
+            rpmsg_destroy_ept(q->ept);
+        if (i < priv->num_queues)
+            netif_napi_del(&q->napi);
+        free_percpu(q->pcpu_stats);
     }
+    destroy_workqueue(priv->tx_wq);
+    free_netdev(rpmsg_netdev);
+    rpmsg_netdev = NULL;
 
     return ret;
 }
@@ -15,6 +15,10 @@
 #include <linux/poll.h>
 
 #include "rpmsg_neo.h"
+#include "rpmsg_neo_stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "rpmsg_neo_trace.h"
 
 
 
@@ -152,9 +156,12 @@ static int __init rpmsg_init(void)
 {
     int err = 0;
 
+    rpmsg_neo_stats_init();
+
     if ( (err = register_rpmsg_driver(&rpmsg_proxy_dev_drv)) != 0)
     {
         pr_err("ERROR: %s %d rc=%d\n",  __FUNCTION__, __LINE__,err);
+        rpmsg_neo_stats_exit();
     }
 
     return err;
@@ -163,6 +170,7 @@ static int __init rpmsg_init(void)
 static void __exit rpmsg_exit(void)
 {
     unregister_rpmsg_driver(&rpmsg_proxy_dev_drv);
+    rpmsg_neo_stats_exit();
 }
 
 
@@ -0,0 +1,155 @@
+/* * RPMSG Neo per endpoint statistics
+ *
+ * Copyright (C) 2016 Tim Michals
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/fs.h>
+
+#include "rpmsg_neo_stats.h"
+
+static struct dentry *rpmsg_neo_debugfs;
+
+static void rpmsg_neo_stats_reset(struct rpmsg_neo_stats *st)
+{
+    int i;
+
+    atomic64_set(&st->msgs_in, 0);
+    atomic64_set(&st->bytes_in, 0);
+    atomic64_set(&st->msgs_out, 0);
+    atomic64_set(&st->bytes_out, 0);
+    atomic64_set(&st->drops, 0);
+    atomic64_set(&st->send_fail, 0);
+    atomic64_set(&st->wakeups, 0);
+    atomic64_set(&st->blocked_ns, 0);
+    atomic_set(&st->queue_hwm, 0);
+
+    for (i = 0; i < RPMSG_NEO_HIST_BUCKETS; i++)
+    {
+        atomic64_set(&st->rx_lat[i], 0);
+        atomic64_set(&st->tx_lat[i], 0);
+    }
+}
+
+static void rpmsg_neo_stats_show_hist(struct seq_file *m, const char *title,
+                                      atomic64_t *hist)
+{
+    int i;
+
+    seq_printf(m, "%s:\n", title);
+
+    for (i = 0; i < RPMSG_NEO_HIST_BUCKETS; i++)
+    {
+        u64 n = atomic64_read(&hist[i]);
+
+        if (!n)
+            continue;
+
+        if (i == 0)
+            seq_printf(m, "  %10s   %7s %llu\n", "0", "", n);
+        else if (i == RPMSG_NEO_HIST_BUCKETS - 1)
+            seq_printf(m, "  %10llu - %7s %llu\n", 1ULL << (i - 1), "", n);
+        else
+            seq_printf(m, "  %10llu - %7llu %llu\n", 1ULL << (i - 1),
+                       (1ULL << i) - 1, n);
+    }
+}
+
+static int rpmsg_neo_stats_show(struct seq_file *m, void *v)
+{
+    struct rpmsg_neo_stats *st = m->private;
+
+    seq_printf(m, "msgs_in:    %lld\n", atomic64_read(&st->msgs_in));
+    seq_printf(m, "bytes_in:   %lld\n", atomic64_read(&st->bytes_in));
+    seq_printf(m, "msgs_out:   %lld\n", atomic64_read(&st->msgs_out));
+    seq_printf(m, "bytes_out:  %lld\n", atomic64_read(&st->bytes_out));
+    seq_printf(m, "queue_hwm:  %d\n", atomic_read(&st->queue_hwm));
+    seq_printf(m, "drops:      %lld\n", atomic64_read(&st->drops));
+    seq_printf(m, "send_fail:  %lld\n", atomic64_read(&st->send_fail));
+    seq_printf(m, "wakeups:    %lld\n", atomic64_read(&st->wakeups));
+    seq_printf(m, "blocked_ns: %lld\n", atomic64_read(&st->blocked_ns));
+
+    rpmsg_neo_stats_show_hist(m, "rx_latency_ns (callback to read)", st->rx_lat);
+    rpmsg_neo_stats_show_hist(m, "tx_latency_ns (write to sent)", st->tx_lat);
+
+    return 0;
+}
+
+static int rpmsg_neo_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, rpmsg_neo_stats_show, inode->i_private);
+}
+
+/* any write resets the counters */
+static ssize_t rpmsg_neo_stats_write(struct file *file, const char __user *ubuf,
+                                     size_t count, loff_t *ppos)
+{
+    struct seq_file *m = file->private_data;
+
+    rpmsg_neo_stats_reset(m->private);
+
+    return count;
+}
+
+static const struct file_operations rpmsg_neo_stats_fops =
+{
+    .owner = THIS_MODULE,
+    .open = rpmsg_neo_stats_open,
+    .read = seq_read,
+    .write = rpmsg_neo_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* the counters work without debugfs, there is just nothing to read them */
+void rpmsg_neo_stats_register(struct rpmsg_neo_stats *st, const char *name)
+{
+    st->name = name;
+    st->dentry = NULL;
+
+    if (IS_ERR_OR_NULL(rpmsg_neo_debugfs))
+        return;
+
+    st->dentry = debugfs_create_file(name, 0600, rpmsg_neo_debugfs, st,
+                                     &rpmsg_neo_stats_fops);
+    if (IS_ERR_OR_NULL(st->dentry))
+    {
+        pr_err("ERROR: %s %d no debugfs entry for %s\n", __FUNCTION__, __LINE__, name);
+        st->dentry = NULL;
+    }
+}
+
+void rpmsg_neo_stats_unregister(struct rpmsg_neo_stats *st)
+{
+    debugfs_remove(st->dentry);
+    st->dentry = NULL;
+}
+
+int rpmsg_neo_stats_init(void)
+{
+    rpmsg_neo_debugfs = debugfs_create_dir("rpmsg_neo", NULL);
+    if (IS_ERR_OR_NULL(rpmsg_neo_debugfs))
+    {
+        pr_info("%s %d debugfs not available, no statistics\n", __FUNCTION__, __LINE__);
+        rpmsg_neo_debugfs = NULL;
+    }
+
+    return 0;
+}
+
+void rpmsg_neo_stats_exit(void)
+{
+    debugfs_remove_recursive(rpmsg_neo_debugfs);
+    rpmsg_neo_debugfs = NULL;
+}
@@ -0,0 +1,67 @@
+
+#include <linux/atomic.h>
+#include <linux/log2.h>
+
+/*
+ * Per endpoint counters, one directory entry each under
+ * /sys/kernel/debug/rpmsg_neo/.  Reading the file dumps them, writing
+ * anything to it resets them.  Every field is updated lock-free, from
+ * whatever context the service happens to run in.
+ */
+#define RPMSG_NEO_HIST_BUCKETS  32      /* log2(ns), the last one takes the rest */
+
+struct rpmsg_neo_stats
+{
+    const char *name;
+    atomic64_t msgs_in;
+    atomic64_t bytes_in;
+    atomic64_t msgs_out;
+    atomic64_t bytes_out;
+    atomic64_t drops;
+    atomic64_t send_fail;
+    atomic64_t wakeups;
+    atomic64_t blocked_ns;      /* time spent in a blocking send */
+    atomic_t   queue_hwm;       /* deepest the receive queue has been */
+    atomic64_t rx_lat[RPMSG_NEO_HIST_BUCKETS];  /* callback to read() */
+    atomic64_t tx_lat[RPMSG_NEO_HIST_BUCKETS];  /* write() to sent */
+    struct dentry *dentry;
+};
+
+extern int rpmsg_neo_stats_init(void);
+extern void rpmsg_neo_stats_exit(void);
+extern void rpmsg_neo_stats_register(struct rpmsg_neo_stats *st, const char *name);
+extern void rpmsg_neo_stats_unregister(struct rpmsg_neo_stats *st);
+
+static inline void rpmsg_neo_stats_rx(struct rpmsg_neo_stats *st, unsigned int len)
+{
+    atomic64_inc(&st->msgs_in);
+    atomic64_add(len, &st->bytes_in);
+}
+
+static inline void rpmsg_neo_stats_tx(struct rpmsg_neo_stats *st, unsigned int len)
+{
+    atomic64_inc(&st->msgs_out);
+    atomic64_add(len, &st->bytes_out);
+}
+
+static inline void rpmsg_neo_stats_queue(struct rpmsg_neo_stats *st, unsigned int depth)
+{
+    int hwm = atomic_read(&st->queue_hwm);
+
+    while (depth > hwm)
+    {
+        int seen = atomic_cmpxchg(&st->queue_hwm, hwm, depth);
+
+        if (seen == hwm)
+            break;
+        hwm = seen;
+    }
+}
+
+/* bucket 0 is 0ns, bucket n counts [2^(n-1), 2^n) ns */
+static inline void rpmsg_neo_stats_lat(atomic64_t *hist, s64 ns)
+{
+    unsigned int bucket = ns > 0 ? fls64(ns) : 0;
+
+    atomic64_inc(&hist[min_t(unsigned int, bucket, RPMSG_NEO_HIST_BUCKETS - 1)]);
+}
@@ -0,0 +1,77 @@
+/*
+ * Tracepoints for the send and receive paths of every rpmsg-neo service,
+ * under events/rpmsg_neo/ in tracefs (perf list 'rpmsg_neo:*').
+ *
+ * endpt is the local endpoint, addr the remote one (source on receive,
+ * destination on send, 0 for a proxy read() that may span sources),
+ * depth the messages still queued on the proxy's receive ring after the
+ * event; services without a queue report 0.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rpmsg_neo
+
+#if !defined(_RPMSG_NEO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RPMSG_NEO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(rpmsg_neo_msg,
+
+    TP_PROTO(u32 endpt, u32 addr, int len, u32 depth),
+
+    TP_ARGS(endpt, addr, len, depth),
+
+    TP_STRUCT__entry(
+        __field(u32, endpt)
+        __field(u32, addr)
+        __field(int, len)
+        __field(u32, depth)
+    ),
+
+    TP_fast_assign(
+        __entry->endpt = endpt;
+        __entry->addr = addr;
+        __entry->len = len;
+        __entry->depth = depth;
+    ),
+
+    TP_printk("endpt=%u addr=%u len=%d depth=%u",
+              __entry->endpt, __entry->addr, __entry->len, __entry->depth)
+);
+
+DEFINE_EVENT(rpmsg_neo_msg, rpmsg_neo_proxy_rx,
+    TP_PROTO(u32 endpt, u32 addr, int len, u32 depth),
+    TP_ARGS(endpt, addr, len, depth));
+
+DEFINE_EVENT(rpmsg_neo_msg, rpmsg_neo_proxy_read,
+    TP_PROTO(u32 endpt, u32 addr, int len, u32 depth),
+    TP_ARGS(endpt, addr, len, depth));
+
+DEFINE_EVENT(rpmsg_neo_msg, rpmsg_neo_proxy_write,
+    TP_PROTO(u32 endpt, u32 addr, int len, u32 depth),
+    TP_ARGS(endpt, addr, len, depth));
+
+DEFINE_EVENT(rpmsg_neo_msg, rpmsg_neo_tty_rx,
+    TP_PROTO(u32 endpt, u32 addr, int len, u32 depth),
+    TP_ARGS(endpt, addr, len, depth));
+
+DEFINE_EVENT(rpmsg_neo_msg, rpmsg_neo_tty_write,
+    TP_PROTO(u32 endpt, u32 addr, int len, u32 depth),
+    TP_ARGS(endpt, addr, len, depth));
+
+DEFINE_EVENT(rpmsg_neo_msg, rpmsg_neo_ether_rx,
+    TP_PROTO(u32 endpt, u32 addr, int len, u32 depth),
+    TP_ARGS(endpt, addr, len, depth));
+
+DEFINE_EVENT(rpmsg_neo_msg, rpmsg_neo_ether_xmit,
+    TP_PROTO(u32 endpt, u32 addr, int len, u32 depth),
+    TP_ARGS(endpt, addr, len, depth));
+
+#endif /* _RPMSG_NEO_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rpmsg_neo_trace
+#include <trace/define_trace.h>
@@ -20,9 +20,12 @@
 #include <linux/tty_driver.h>
 #include <linux/tty_flip.h>
 #include <linux/virtio.h>
+#include <linux/ktime.h>
 
 #include "rpmsg_neo.h"
 #include "rpmsg_neoproxy.h"
+#include "rpmsg_neo_stats.h"
+#include "rpmsg_neo_trace.h"
 
 #define RPMSG_MAX_SIZE	MAX_RPMSG_BUFF_SIZE
 #define MSG		"hello world!"
@@ -39,6 +42,7 @@ struct rpmsgtty_port
     struct rpmsg_endpoint   *ept;
     char tx_buff[RPMSG_MAX_SIZE]; /* buffer to keep the message to send */
     int endpt;
+    struct rpmsg_neo_stats stats;
 
 };
 
@@ -54,26 +58,29 @@ static void rpmsg_tty_cb(struct rpmsg_channel *rpdev, void *data, int len,
     /* flush the recv-ed none-zero data to tty node */
     if (len == 0)
         return;
- /*
-    pr_info("%s lenrcved=%d\n", __FUNCTION__, len);
-    print_hex_dump(KERN_DEBUG, __func__, DUMP_PREFIX_NONE, 16, 1,
-                    data, len,  true);
-*/                    
+
+    rpmsg_neo_stats_rx(&cport->stats, len);
+    trace_rpmsg_neo_tty_rx(cport->endpt, src, len, 0);
 
     spin_lock_bh(&cport->rx_lock);
     space = tty_prepare_flip_string(&cport->port, &cbuf, len);
     if (space <= 0)
     {
         dev_err(&rpdev->dev, "No memory for tty_prepare_flip_string\n");
+        atomic64_inc(&cport->stats.drops);
         spin_unlock_bh(&cport->rx_lock);
         return;
     }
 
     if( space != len)
+    {
         pr_err("Trunc buffer %d\n", len-space);
+        atomic64_inc(&cport->stats.drops);
+    }
 
     memcpy(cbuf, data, space);
     tty_flip_buffer_push(&cport->port);
+    atomic64_inc(&cport->stats.wakeups);
     spin_unlock_bh(&cport->rx_lock);
 }
 
@@ -102,6 +109,8 @@ static int rpmsgtty_write(struct tty_struct *tty, const unsigned char *buf,
     struct rpmsgtty_port *rptty_port = container_of(tty->port,
                                        struct rpmsgtty_port, port);
     struct rpmsg_channel *rpmsg_chnl = rptty_port->rpmsg_chnl;
+    u64 start = ktime_get_ns();
+    u64 now;
 
     if (NULL == buf)
     {
@@ -114,19 +123,23 @@ static int rpmsgtty_write(struct tty_struct *tty, const unsigned char *buf,
 
     do
     {
-/*
-pr_info("%s lentx=%d\n", __FUNCTION__, total);
- 	print_hex_dump(KERN_DEBUG, __func__, DUMP_PREFIX_NONE, 16, 1,buf, total,  true);
-*/
         /* send a message to our remote processor */
+        now = ktime_get_ns();
         ret = rpmsg_sendto(rpmsg_chnl, (void *)tbuf,
                            count > RPMSG_MAX_SIZE ? RPMSG_MAX_SIZE : count, rptty_port->endpt);
+        atomic64_add(ktime_get_ns() - now, &rptty_port->stats.blocked_ns);
         if (ret)
         {
+            atomic64_inc(&rptty_port->stats.send_fail);
             dev_err(&rpmsg_chnl->dev, "rpmsg_send failed: %d\n", ret);
             return ret;
         }
 
+        rpmsg_neo_stats_tx(&rptty_port->stats, count > RPMSG_MAX_SIZE ? RPMSG_MAX_SIZE : count);
+        trace_rpmsg_neo_tty_write(rptty_port->endpt, rptty_port->endpt,
+                                  count > RPMSG_MAX_SIZE ? RPMSG_MAX_SIZE : count, 0);
+        rpmsg_neo_stats_lat(rptty_port->stats.tx_lat, ktime_get_ns() - start);
+
         if (count > RPMSG_MAX_SIZE)
         {
             count -= RPMSG_MAX_SIZE;
@@ -168,6 +181,7 @@ static int rpmsg_neo_tty_remove(void )
 
     pr_info("INFO: %s %s %d\n", __FILE__, __FUNCTION__, __LINE__);
 
+    rpmsg_neo_stats_unregister(&cport->stats);
     tty_unregister_driver(rpmsgtty_driver);
     put_tty_driver(rpmsgtty_driver);
     tty_port_destroy(&cport->port);
@@ -240,6 +254,8 @@ rpmsgtty_driver->init_termios.c_cflag |= CLOCAL;
         pr_info("Install rpmsg tty driver!\n");
     }
 
+    rpmsg_neo_stats_register(&cport->stats, "ttyrpmsg");
+
     return 0;
 
 error:
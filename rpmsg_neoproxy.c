@@ -23,286 +23,1754 @@
 #include <linux/mutex.h>
 #include <linux/wait.h>
 #include <linux/fs.h>
-#include <linux/kfifo.h>
 #include <linux/uaccess.h>
 #include <linux/kthread.h>
 #include <linux/ioctl.h>
 #include <linux/errno.h>
 #include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/uio.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/timex.h>
+#include <linux/sched.h>
 
 #include "rpmsg_neo.h"
 #include "rpmsg_neoproxy.h"
+#include "rpmsg_neo_stats.h"
+#include "rpmsg_neo_trace.h"
 
-#define RPMSG_KFIFO_SIZE                (MAX_RPMSG_BUFF_SIZE * 4)
+/* ring depths in messages, must be a power of two */
+#define RPMSG_RING_SLOTS                32
+#define RPMSG_RING_MAX_SLOTS            4096
+#define RPMSG_TX_RING_SLOTS             32
 
 #define IOCTL_CMD_GET_KFIFO_SIZE        1
 #define IOCTL_CMD_GET_AVAIL_DATA_SIZE   2
 #define IOCTL_CMD_GET_FREE_BUFF_SIZE    3
+#define IOCTL_CMD_SET_RECORD_MODE       4
+#define IOCTL_CMD_GET_RECORD_MODE       5
+#define IOCTL_CMD_GET_MMAP_SIZE         6
+#define IOCTL_CMD_MMAP_TX_KICK          7
+#define IOCTL_CMD_SET_RX_SLOTS          8
+#define IOCTL_CMD_GET_RX_SLOTS          9
+#define IOCTL_CMD_SET_OVERFLOW_POLICY   10
+#define IOCTL_CMD_GET_OVERFLOW_POLICY   11
+#define IOCTL_CMD_GET_RX_STATS          12
+#define IOCTL_CMD_CREATE_DEVICE         13
+#define IOCTL_CMD_DESTROY_DEVICE        14
+#define IOCTL_CMD_SET_TX_FRAG           15
+#define IOCTL_CMD_GET_TX_FRAG           16
+#define IOCTL_CMD_RECV_BATCH            17
+#define IOCTL_CMD_SET_RX_TSTAMP         18
+#define IOCTL_CMD_GET_RX_TSTAMP         19
+#define IOCTL_CMD_SET_RX_LOWAT          20
+#define IOCTL_CMD_GET_RX_LOWAT          21
+#define IOCTL_CMD_SET_BUSY_POLL         22
+#define IOCTL_CMD_GET_BUSY_POLL         23
+#define IOCTL_CMD_SET_RX_BLOCK_MS       24
+#define IOCTL_CMD_GET_RX_BLOCK_MS       25
+
+/*
+ * Clock the endpoint callback stamps every message with, as early as it
+ * can: before it copies or waits for room.  Delivered by the batch ioctl,
+ * RPMSG_MODE_RECORD_TS reads and the mapped slots.  CYCLES is get_cycles(),
+ * which reads 0 on cores without a usable cycle counter.
+ */
+#define RPMSG_TSTAMP_NONE               0
+#define RPMSG_TSTAMP_MONOTONIC          1
+#define RPMSG_TSTAMP_MONOTONIC_RAW      2
+#define RPMSG_TSTAMP_CYCLES             3
+
+/*
+ * What the endpoint callback does with a message when the receive ring
+ * is full.  Drop-oldest only applies while nobody has the rings mapped,
+ * a mapping process owns rx_tail.  Block-remote makes the callback wait
+ * (up to rx_block_ms, or IOCTL_CMD_SET_RX_BLOCK_MS per device) for a
+ * reader: the vring buffer is not returned, so the M4 runs out of TX
+ * buffers and throttles.  This stalls every endpoint on the channel, not
+ * only the proxy, hence the cap on the per-device wait.
+ */
+#define RPMSG_OVERFLOW_DROP_NEWEST      0
+#define RPMSG_OVERFLOW_DROP_OLDEST      1
+#define RPMSG_OVERFLOW_BLOCK_REMOTE     2
+#define RPMSG_BLOCK_MS_MAX              1000
+
+/*
+ * IOCTL_CMD_CREATE_DEVICE: bind a new /dev/rpmsgN to a local endpoint,
+ * with its own queues, and send to 'remote' by default.  Destroy it with
+ * IOCTL_CMD_DESTROY_DEVICE and N once nobody has it open or mapped.
+ */
+/*
+ * write()/writev() split anything larger than one rpmsg into as many
+ * messages as needed.  With IOCTL_CMD_SET_TX_FRAG enabled every message
+ * starts with this header so the remote can put one write() back
+ * together: all fragments of a write share seq, frag counts up from 0.
+ */
+#define RPMSG_FRAG_FIRST                0x01
+#define RPMSG_FRAG_LAST                 0x02
+
+struct rpmsg_neo_frag_hdr
+{
+    u16 seq;
+    u8  flags;
+    u8  frag;
+};
+
+/*
+ * IOCTL_CMD_RECV_BATCH: fill up to vlen descriptors, one message each, in
+ * one call.  Waits until at least min messages were returned (min is
+ * clamped to vlen and the ring depth), timeout_ms expires (< 0 waits
+ * forever, 0 never waits) or a signal arrives; O_NONBLOCK never waits.
+ * Returns the number of descriptors filled, also stored in count.
+ */
+#define RPMSG_MMSG_TRUNC                0x01    /* message did not fit len */
+
+struct rpmsg_neo_mmsg
+{
+    u64 buf;        /* in: user buffer */
+    u32 len;        /* in: buffer size, out: bytes stored */
+    u32 src;        /* out: remote endpoint */
+    u64 ts;         /* out: arrival time, see IOCTL_CMD_SET_RX_TSTAMP */
+    u32 flags;      /* out: RPMSG_MMSG_* */
+    u32 reserved;
+};
+
+/*
+ * IOCTL_CMD_SET_RX_LOWAT: readers (blocking read(), poll() POLLIN) are
+ * only woken once msgs messages or bytes payload bytes are queued, or
+ * coalesce_us after data arrived at the latest.  0 turns a threshold off;
+ * with both off every message wakes readers, the default.  A full ring
+ * always wakes.  O_NONBLOCK reads still return whatever is queued.
+ */
+struct rpmsg_neo_rx_lowat
+{
+    u32 msgs;
+    u32 bytes;
+    u32 coalesce_us;
+};
+
+/*
+ * IOCTL_CMD_SET_BUSY_POLL, per file descriptor: a blocking read() spins
+ * on the ring for up to budget_us before it sleeps, like SO_BUSY_POLL.
+ * With adaptive set the spin follows how long data actually took to
+ * show up, never longer than budget_us.  Spinning stops early when the
+ * scheduler wants the CPU or a signal is pending.  budget_us may not
+ * exceed the busy_poll_max_us module parameter (-EINVAL).
+ */
+struct rpmsg_neo_busy_poll
+{
+    u32 budget_us;
+    u32 adaptive;
+};
+
+struct rpmsg_neo_mmsg_req
+{
+    u64 vec;        /* struct rpmsg_neo_mmsg[vlen] */
+    u32 vlen;
+    u32 min;
+    s32 timeout_ms;
+    u32 count;      /* out */
+};
+
+struct rpmsg_neo_dev_req
+{
+    u32 local;      /* local endpoint address to bind */
+    u32 remote;     /* default destination for write() and the TX ring */
+    u32 index;      /* out: N of the new /dev/rpmsgN */
+};
+
+struct rpmsg_neo_rx_stats
+{
+    u64 rx_msgs;        /* messages queued for userspace */
+    u64 drop_full;      /* drop-newest: ring was full */
+    u64 drop_oldest;    /* drop-oldest: queued message discarded */
+    u64 drop_oversize;  /* larger than a slot */
+    u64 blocked;        /* block-remote: callback had to wait */
+    u64 block_timeout;  /* block-remote: waited rx_block_ms, then dropped */
+};
+
+/*
+ * Record mode: every read() returns exactly one rpmsg, prefixed by
+ * struct rpmsg_neo_rec_hdr (struct rpmsg_neo_rec_ts_hdr in
+ * RPMSG_MODE_RECORD_TS).  A read buffer smaller than the record
+ * truncates it, the rest of that message is discarded (datagram semantics),
+ * but it must at least hold the header.
+ */
+#define RPMSG_MODE_STREAM               0
+#define RPMSG_MODE_RECORD               1
+#define RPMSG_MODE_RECORD_TS            2
+
+struct rpmsg_neo_rec_hdr
+{
+    u32 src;    /* remote endpoint the message came from */
+    u32 len;    /* payload length following this header */
+};
+
+struct rpmsg_neo_rec_ts_hdr
+{
+    u32 src;
+    u32 len;
+    u64 ts;     /* arrival time, see IOCTL_CMD_SET_RX_TSTAMP */
+};
+
+
+/*
+ * mmap() layout of /dev/rpmsg0, see IOCTL_CMD_GET_MMAP_SIZE:
+ *   page 0:       struct rpmsg_neo_ring_ctrl
+ *   rx_offset:    rx_slots x struct rpmsg_neo_slot, filled by the driver
+ *   tx_offset:    tx_slots x struct rpmsg_neo_slot, filled by userspace
+ *
+ * Index i lives in slot (i & (slots - 1)); indices run freely and wrap.
+ * Userspace consumes RX by advancing rx_tail (read() returns -EBUSY while
+ * the device is mapped) and produces TX by filling slots, advancing
+ * tx_head and calling IOCTL_CMD_MMAP_TX_KICK.  poll() POLLIN reports RX.
+ */
+#define RPMSG_NEO_RING_VERSION          2
+#define RPMSG_NEO_CACHELINE             64
+
+struct rpmsg_neo_slot
+{
+    u32 addr;   /* rx: source endpoint, tx: destination (0 = device default) */
+    u32 len;
+    u64 ts;     /* rx: arrival time, see IOCTL_CMD_SET_RX_TSTAMP */
+    u8  data[MAX_RPMSG_BUFF_SIZE];
+};
+
+struct rpmsg_neo_ring_ctrl
+{
+    u32 version;
+    u32 slot_size;
+    u32 rx_slots;
+    u32 tx_slots;
+    u32 rx_offset;
+    u32 tx_offset;
+
+    /* each index is written by one side only and owns a cache line */
+    u32 rx_head __aligned(RPMSG_NEO_CACHELINE);     /* driver */
+    u32 rx_tail __aligned(RPMSG_NEO_CACHELINE);     /* reader */
+    u32 tx_head __aligned(RPMSG_NEO_CACHELINE);     /* userspace */
+    u32 tx_tail __aligned(RPMSG_NEO_CACHELINE);     /* driver */
+};
 
 
 #define RPMG_INIT_MSG "init_msg"
 
+/*
+ * Single producer / single consumer message ring.  *head is only written
+ * by the producer and *tail only by the consumer, each on its own cache
+ * line in the shared control page, so neither side ever waits on a lock
+ * the other holds.  For RX the producer is the endpoint callback and the
+ * consumer is read() (serialized by read_lock) or a mapping process; for
+ * TX it is the other way around.
+ */
+struct _rpmsg_ring
+{
+    struct rpmsg_neo_slot *slots;
+    u32 *head;
+    u32 *tail;
+    u32 mask;
+    u32 offset;     /* bytes of slot offset_tail already read in stream mode */
+    u32 offset_tail;
+};
+
 struct _rpmsg_params
 {
     wait_queue_head_t usr_wait_q;
-    struct mutex sync_lock;
-    struct kfifo rpmsg_kfifo;
-    int block_flag;
+    wait_queue_head_t space_wait_q;     /* block-remote callback */
+    wait_queue_head_t tx_wait_q;        /* POLLOUT */
+    int tx_full;                /* last try-send found no free TX buffer */
+    struct hrtimer tx_retry_timer;
+    struct rpmsg_neo_rx_lowat lowat;
+    int rx_flush;               /* coalesce timer expired with data queued */
+    atomic_t rx_timer_armed;
+    struct hrtimer rx_coalesce_timer;
+
+    /* payload byte accounting for the byte low-watermark */
+    u32 rx_bytes_in ____cacheline_aligned_in_smp;   /* callback */
+    u32 rx_bytes_dropped;                           /* callback, drop-oldest */
+    u32 rx_bytes_out ____cacheline_aligned_in_smp;  /* consumer */
+    struct mutex read_lock;     /* consumer side only */
+    struct mutex tx_lock;       /* serializes TX ring drains */
+    struct _rpmsg_ring ring;
+    struct _rpmsg_ring tx_ring;
+    void *area;                 /* vmalloc_user() control page + slots */
+    size_t area_size;
+    atomic_t mmap_count;
+    int resizing;
+    int record_mode;
+    int tx_frag;                /* prepend struct rpmsg_neo_frag_hdr */
+    int rx_tstamp;              /* RPMSG_TSTAMP_* */
+    u16 tx_seq;                 /* tx_lock */
+    int overflow_policy;
+    unsigned int block_ms;
+    char rx_bounce[MAX_RPMSG_BUFF_SIZE];    /* drop-oldest reads, read_lock */
+    struct rpmsg_neo_rx_stats stats;        /* written by the callback only */
+    struct u64_stats_sync stats_sync;
+    struct rpmsg_neo_stats ept_stats;       /* debugfs */
     struct rpmsg_channel *rpmsg_chnl;
     struct rpmsg_endpoint *ept;
-    char tx_buff[RPMSG_KFIFO_SIZE]; /* buffer to keep the message to send */
+    char tx_buff[MAX_RPMSG_BUFF_SIZE]; /* buffer to keep the message to send */
     u32 endpt;
+    u32 remote_endpt;
+};
+
+struct _rpmsg_device
+{
+    struct miscdevice 	  device;
+    struct _rpmsg_params  rpmsg_params;
+    int                   endpt;
+    int                   index;
+    char                  name[16];
+    atomic_t              open_count;
+    int                   dead;
+    struct kref           ref;          /* the list, open files, mappings */
+    struct list_head      node;
+};
+
+/* per open(), filp->private_data */
+struct _rpmsg_file
+{
+    struct _rpmsg_device       *rdev;
+    struct rpmsg_neo_busy_poll  busy_poll;
+    u64                         spin_ns;    /* adaptive spin length */
+};
+
+/* all proxy devices, /dev/rpmsg0 first */
+static LIST_HEAD(rpmsg_proxy_devices);
+static DEFINE_MUTEX(rpmsg_proxy_lock);
+static DEFINE_IDA(rpmsg_proxy_ida);
+static struct rpmsg_channel *rpmsg_proxy_chnl;
+
+static int rpmsg_proxy_create(u32 local_endpt, u32 remote_endpt);
+static int rpmsg_proxy_destroy(int index);
+
+static unsigned int rx_slots = RPMSG_RING_SLOTS;
+module_param(rx_slots, uint, 0444);
+MODULE_PARM_DESC(rx_slots, "proxy receive queue depth in messages, rounded up to a power of two");
+
+static unsigned int rx_overflow = RPMSG_OVERFLOW_DROP_NEWEST;
+module_param(rx_overflow, uint, 0444);
+MODULE_PARM_DESC(rx_overflow, "proxy receive overflow policy: 0 drop-newest, 1 drop-oldest, 2 block-remote");
+
+static unsigned int rx_block_ms = 100;
+module_param(rx_block_ms, uint, 0444);
+MODULE_PARM_DESC(rx_block_ms, "longest a block-remote callback waits for a reader, in ms");
+
+static unsigned int tx_retry_us = 500;
+module_param(tx_retry_us, uint, 0644);
+MODULE_PARM_DESC(tx_retry_us, "after a non-blocking send found the vring full, report POLLOUT again after this many us");
+
+static unsigned int busy_poll_max_us = 1000;
+module_param(busy_poll_max_us, uint, 0644);
+MODULE_PARM_DESC(busy_poll_max_us, "largest IOCTL_CMD_SET_BUSY_POLL budget a reader may spin, in us (0 disables busy polling)");
+
+#define rpmsg_rx_stat_inc(local, field)                 \
+    do {                                                \
+        u64_stats_update_begin(&(local)->stats_sync);   \
+        (local)->stats.field++;                         \
+        u64_stats_update_end(&(local)->stats_sync);     \
+    } while (0)
+
+static inline bool rpmsg_ring_empty(struct _rpmsg_ring *ring)
+{
+    return smp_load_acquire(ring->head) == READ_ONCE(*ring->tail);
+}
+
+static inline u32 rpmsg_ring_count(struct _rpmsg_ring *ring)
+{
+    return smp_load_acquire(ring->head) - READ_ONCE(*ring->tail);
+}
+
+/*
+ * Anyone looking at the RX ring without read_lock (poll, sleeping and
+ * spinning readers, ioctls) does it under RCU: a resize swaps the ring
+ * under read_lock and frees the old area only after a grace period.
+ */
+static inline u32 rpmsg_ring_count_rcu(struct _rpmsg_ring *ring)
+{
+    u32 count;
+
+    rcu_read_lock();
+    count = rpmsg_ring_count(ring);
+    rcu_read_unlock();
+
+    return count;
+}
+
+/* head - tail, at most the ring size even if a mapping process scribbled on them */
+static inline u32 rpmsg_ring_pending(struct _rpmsg_ring *ring, u32 head, u32 tail)
+{
+    return min(head - tail, ring->mask + 1);
+}
+
+/* payload bytes still waiting to be read, approximate without read_lock */
+static unsigned int rpmsg_ring_bytes(struct _rpmsg_ring *ring)
+{
+    u32 tail = READ_ONCE(*ring->tail);
+    u32 head = smp_load_acquire(ring->head);
+    u32 n = rpmsg_ring_pending(ring, head, tail);
+    u32 off = READ_ONCE(ring->offset_tail) == tail ? READ_ONCE(ring->offset) : 0;
+    unsigned int bytes = 0;
+
+    for (; n; n--, tail++)
+        bytes += min_t(u32, ring->slots[tail & ring->mask].len, MAX_RPMSG_BUFF_SIZE);
+
+    return bytes - min_t(unsigned int, bytes, off);
+}
+
+/* resize to fewer slots: drop the oldest messages that no longer fit */
+static void rpmsg_rx_ring_trim(struct _rpmsg_params *local, struct _rpmsg_ring *ring,
+                               unsigned int slots)
+{
+    u32 head = *ring->head;
+    u32 tail = *ring->tail;
+
+    for (; rpmsg_ring_pending(ring, head, tail) > slots; tail++)
+    {
+        local->rx_bytes_dropped += min_t(u32, ring->slots[tail & ring->mask].len,
+                                         MAX_RPMSG_BUFF_SIZE);
+        rpmsg_rx_stat_inc(local, drop_oldest);
+        atomic64_inc(&local->ept_stats.drops);
+    }
+    *ring->tail = tail;
+}
+
+/* copy what is queued on 'from' to the empty ring 'to', as many as fit */
+static void rpmsg_ring_move(struct _rpmsg_ring *to, struct _rpmsg_ring *from)
+{
+    u32 tail = *from->tail;
+    u32 n = min(rpmsg_ring_pending(from, *from->head, tail), to->mask + 1);
+    u32 i;
+
+    for (i = 0; i < n; i++)
+    {
+        struct rpmsg_neo_slot *src = &from->slots[(tail + i) & from->mask];
+        struct rpmsg_neo_slot *dst = &to->slots[i];
+
+        dst->addr = src->addr;
+        dst->len = src->len;
+        dst->ts = src->ts;
+        memcpy(dst->data, src->data, min_t(u32, src->len, MAX_RPMSG_BUFF_SIZE));
+    }
+
+    /* a message read part way in stream mode goes on where it was */
+    if (n && from->offset_tail == tail)
+    {
+        to->offset = from->offset;
+        to->offset_tail = 0;
+    }
+    *to->head = n;
+}
+
+/*
+ * One zeroed, mappable area: control page, then the rx and tx slots.
+ * Replaces (and frees) the current area only once the new one exists,
+ * carrying the queued messages over; RX messages that no longer fit are
+ * counted as drop-oldest.  The caller makes sure the callback and
+ * consumers are not using it.
+ */
+static int rpmsg_rings_alloc(struct _rpmsg_params *local,
+                             unsigned int rx_slots, unsigned int tx_slots)
+{
+    struct rpmsg_neo_ring_ctrl *ctrl;
+    size_t rx_offset = PAGE_ALIGN(sizeof(*ctrl));
+    size_t tx_offset = rx_offset + rx_slots * sizeof(struct rpmsg_neo_slot);
+    size_t area_size = PAGE_ALIGN(tx_offset + tx_slots * sizeof(struct rpmsg_neo_slot));
+    struct _rpmsg_ring old_rx = local->ring;
+    struct _rpmsg_ring old_tx = local->tx_ring;
+    void *old = local->area;
+
+    ctrl = vmalloc_user(area_size);
+    if (!ctrl)
+        return -ENOMEM;
+
+    local->area = ctrl;
+    local->area_size = area_size;
+    ctrl->version = RPMSG_NEO_RING_VERSION;
+    ctrl->slot_size = sizeof(struct rpmsg_neo_slot);
+    ctrl->rx_slots = rx_slots;
+    ctrl->tx_slots = tx_slots;
+    ctrl->rx_offset = rx_offset;
+    ctrl->tx_offset = tx_offset;
+
+    local->ring.slots = local->area + rx_offset;
+    local->ring.head = &ctrl->rx_head;
+    local->ring.tail = &ctrl->rx_tail;
+    local->ring.mask = rx_slots - 1;
+    local->ring.offset = 0;
+
+    local->tx_ring.slots = local->area + tx_offset;
+    local->tx_ring.head = &ctrl->tx_head;
+    local->tx_ring.tail = &ctrl->tx_tail;
+    local->tx_ring.mask = tx_slots - 1;
+    local->tx_ring.offset = 0;
+
+    if (old)
+    {
+        rpmsg_rx_ring_trim(local, &old_rx, rx_slots);
+        rpmsg_ring_move(&local->ring, &old_rx);
+        rpmsg_ring_move(&local->tx_ring, &old_tx);
+
+        /* lockless readers hold RCU, see rpmsg_ring_count_rcu() */
+        synchronize_rcu();
+        vfree(old);
+    }
+
+    return 0;
+}
+
+static void rpmsg_rings_free(struct _rpmsg_params *local)
+{
+    vfree(local->area);
+    local->area = NULL;
+}
+
+/*
+ * Stream-mode offset into slot 'tail'.  Drop-oldest may have taken the
+ * partly read slot away, then the offset belongs to a message that is
+ * gone and the one now at the tail starts from the beginning.
+ */
+static inline u32 rpmsg_ring_offset(struct _rpmsg_ring *ring, u32 tail)
+{
+    if (ring->offset_tail != tail)
+        ring->offset = 0;
+
+    return ring->offset;
+}
+
+/* consumer: release the tail slot back to the producer */
+static inline void rpmsg_ring_consume(struct _rpmsg_ring *ring)
+{
+    ring->offset = 0;
+    smp_store_release(ring->tail, *ring->tail + 1);
+}
+
+static inline u64 rpmsg_rx_tstamp(struct _rpmsg_params *local)
+{
+    switch (READ_ONCE(local->rx_tstamp))
+    {
+    case RPMSG_TSTAMP_MONOTONIC:
+        return ktime_get_ns();
+    case RPMSG_TSTAMP_MONOTONIC_RAW:
+        return ktime_get_raw_ns();
+    case RPMSG_TSTAMP_CYCLES:
+        return get_cycles();
+    }
+
+    return 0;
+}
+
+/* callback to read() latency, only the nanosecond clocks can tell */
+static void rpmsg_rx_latency(struct _rpmsg_params *local, u64 ts)
+{
+    int clock = READ_ONCE(local->rx_tstamp);
+
+    if (clock == RPMSG_TSTAMP_MONOTONIC || clock == RPMSG_TSTAMP_MONOTONIC_RAW)
+        rpmsg_neo_stats_lat(local->ept_stats.rx_lat, rpmsg_rx_tstamp(local) - ts);
+}
+
+/*
+ * RX flavour of rpmsg_ring_consume(): under drop-oldest the callback may
+ * advance rx_tail itself, so commit with cmpxchg and let a blocked
+ * (block-remote) callback know a slot is free.  Returns false if the
+ * callback had already dropped the slot.
+ */
+static bool rpmsg_rx_consume(struct _rpmsg_params *local, u32 tail)
+{
+    struct _rpmsg_ring *ring = &local->ring;
+    struct rpmsg_neo_slot *slot = &ring->slots[tail & ring->mask];
+    u32 len = min_t(u32, READ_ONCE(slot->len), MAX_RPMSG_BUFF_SIZE);
+    u64 ts = READ_ONCE(slot->ts);
+    bool ours;
+
+    ring->offset = 0;
+    ours = cmpxchg(ring->tail, tail, tail + 1) == tail;
+    if (ours)
+    {
+        WRITE_ONCE(local->rx_bytes_out, local->rx_bytes_out + len);
+        rpmsg_rx_latency(local, ts);
+    }
+
+    /* drained: the next message starts a new coalescing window */
+    if (READ_ONCE(*ring->tail) == smp_load_acquire(ring->head))
+        WRITE_ONCE(local->rx_flush, 0);
+
+    if (waitqueue_active(&local->space_wait_q))
+        wake_up(&local->space_wait_q);
+
+    return ours;
+}
+
+/* should readers be woken, see struct rpmsg_neo_rx_lowat */
+static bool rpmsg_rx_ready(struct _rpmsg_params *local)
+{
+    struct _rpmsg_ring *ring = &local->ring;
+    u32 msgs = READ_ONCE(local->lowat.msgs);
+    u32 bytes = READ_ONCE(local->lowat.bytes);
+    u32 count = rpmsg_ring_count(ring);
+    u32 queued;
+
+    if (!count)
+        return false;
+
+    if ((!msgs && !bytes) || count > ring->mask || READ_ONCE(local->rx_flush))
+        return true;
+
+    if (msgs && count >= msgs)
+        return true;
+
+    queued = READ_ONCE(local->rx_bytes_in) - READ_ONCE(local->rx_bytes_dropped) -
+             READ_ONCE(local->rx_bytes_out);
+
+    return bytes && queued >= bytes;
+}
+
+/* rpmsg_rx_ready() for callers without read_lock */
+static bool rpmsg_rx_ready_rcu(struct _rpmsg_params *local)
+{
+    bool ready;
+
+    rcu_read_lock();
+    ready = rpmsg_rx_ready(local);
+    rcu_read_unlock();
+
+    return ready;
+}
+
+/* latency bound of the low-watermark: wake readers for whatever is queued */
+static enum hrtimer_restart rpmsg_rx_coalesce(struct hrtimer *timer)
+{
+    struct _rpmsg_params *local = container_of(timer, struct _rpmsg_params,
+                                               rx_coalesce_timer);
+
+    atomic_set(&local->rx_timer_armed, 0);
+
+    if (!rpmsg_ring_empty(&local->ring))
+    {
+        WRITE_ONCE(local->rx_flush, 1);
+        atomic64_inc(&local->ept_stats.wakeups);
+        wake_up_interruptible(&local->usr_wait_q);
+    }
+
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Copy n bytes at off of RX slot 'tail' to userspace.  Under drop-oldest
+ * the callback may recycle the slot at any time, so the bytes go through
+ * rx_bounce and are only handed out if the slot was still ours after the
+ * copy.  Returns 0, -EFAULT, or -EAGAIN if the slot was dropped.
+ */
+static int rpmsg_rx_copy(struct _rpmsg_params *local, u32 tail,
+                         char __user *ubuff, size_t off, size_t n)
+{
+    struct _rpmsg_ring *ring = &local->ring;
+    void *src = ring->slots[tail & ring->mask].data + off;
+
+    if (READ_ONCE(local->overflow_policy) == RPMSG_OVERFLOW_DROP_OLDEST)
+    {
+        memcpy(local->rx_bounce, src, n);
+        smp_rmb();
+        if (READ_ONCE(*ring->tail) != tail)
+            return -EAGAIN;
+        src = local->rx_bounce;
+    }
+
+    return copy_to_user(ubuff, src, n) ? -EFAULT : 0;
+}
+
+/* one message per call, header first, read_lock held */
+static ssize_t rpmsg_ring_read_record(struct _rpmsg_params *local,
+                                      char __user *ubuff, size_t len)
+{
+    struct _rpmsg_ring *ring = &local->ring;
+    struct rpmsg_neo_rec_ts_hdr hdr;
+    size_t hdr_len;
+    size_t payload;
+    u32 tail;
+    int err;
+
+    /* struct rpmsg_neo_rec_hdr is the leading part of the _ts one */
+    hdr_len = local->record_mode == RPMSG_MODE_RECORD_TS ?
+              sizeof(struct rpmsg_neo_rec_ts_hdr) :
+              sizeof(struct rpmsg_neo_rec_hdr);
+
+    if (len < hdr_len)
+        return -EINVAL;
+
+    do
+    {
+        struct rpmsg_neo_slot *slot;
+
+        tail = READ_ONCE(*ring->tail);
+        slot = &ring->slots[tail & ring->mask];
+
+        /* slots are user-writable once mapped, never trust len */
+        hdr.src = slot->addr;
+        hdr.len = min_t(u32, READ_ONCE(slot->len), MAX_RPMSG_BUFF_SIZE);
+        hdr.ts = slot->ts;
+        payload = min_t(size_t, len - hdr_len, hdr.len);
+
+        err = rpmsg_rx_copy(local, tail, ubuff + hdr_len, 0, payload);
+    }
+    while (err == -EAGAIN);
+
+    if (err || copy_to_user(ubuff, &hdr, hdr_len))
+        return -EFAULT;
+
+    rpmsg_rx_consume(local, tail);
+
+    return hdr_len + payload;
+}
+
+static ssize_t rpmsg_ring_read_stream(struct _rpmsg_params *local,
+                                      char __user *ubuff, size_t len)
+{
+    struct _rpmsg_ring *ring = &local->ring;
+    size_t copied = 0;
+
+    while (copied < len)
+    {
+        u32 tail = READ_ONCE(*ring->tail);
+        struct rpmsg_neo_slot *slot = &ring->slots[tail & ring->mask];
+        u32 slot_len, off;
+        size_t chunk;
+        int err;
+
+        if (tail == smp_load_acquire(ring->head))
+            break;
+
+        off = rpmsg_ring_offset(ring, tail);
+        slot_len = min_t(u32, READ_ONCE(slot->len), MAX_RPMSG_BUFF_SIZE);
+        chunk = min_t(size_t, slot_len - min(off, slot_len), len - copied);
+
+        err = rpmsg_rx_copy(local, tail, ubuff + copied, off, chunk);
+        if (err == -EAGAIN)
+        {
+            /* dropped under us, the rest of that message is gone */
+            ring->offset = 0;
+            continue;
+        }
+        if (err)
+            return copied ? copied : err;
+
+        copied += chunk;
+        ring->offset = off + chunk;
+        ring->offset_tail = tail;
+        if (ring->offset >= slot_len)
+            rpmsg_rx_consume(local, tail);
+    }
+
+    return copied;
+}
+
+/* move the tail message into one batch descriptor, read_lock held */
+static int rpmsg_rx_take(struct _rpmsg_params *local, struct rpmsg_neo_mmsg *msg)
+{
+    struct _rpmsg_ring *ring = &local->ring;
+    char __user *ubuff = u64_to_user_ptr(msg->buf);
+    u32 tail, slot_len, off, n;
+    int err;
+
+    do
+    {
+        struct rpmsg_neo_slot *slot;
+
+        tail = READ_ONCE(*ring->tail);
+        slot = &ring->slots[tail & ring->mask];
+
+        /* whatever stream mode left of a partly read message */
+        off = rpmsg_ring_offset(ring, tail);
+        slot_len = min_t(u32, READ_ONCE(slot->len), MAX_RPMSG_BUFF_SIZE);
+        slot_len -= min(off, slot_len);
+        n = min(msg->len, slot_len);
+
+        msg->src = slot->addr;
+        msg->ts = slot->ts;
+
+        err = rpmsg_rx_copy(local, tail, ubuff, off, n);
+    }
+    while (err == -EAGAIN);
+
+    if (err)
+        return err;
+
+    msg->len = n;
+    msg->flags = n < slot_len ? RPMSG_MMSG_TRUNC : 0;
+    msg->reserved = 0;
+    rpmsg_rx_consume(local, tail);
+
+    return 0;
+}
+
+static long rpmsg_rx_batch(struct file *filp, struct _rpmsg_params *local,
+                           struct rpmsg_neo_mmsg_req __user *ureq)
+{
+    struct rpmsg_neo_mmsg_req req;
+    struct rpmsg_neo_mmsg msg;
+    struct rpmsg_neo_mmsg __user *uvec;
+    long remaining;
+    u32 filled = 0;
+    u32 need;
+    int err = 0;
+
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EACCES;
+
+    uvec = u64_to_user_ptr(req.vec);
+    need = min(req.min, req.vlen);
+    remaining = req.timeout_ms < 0 ? MAX_SCHEDULE_TIMEOUT :
+                msecs_to_jiffies(req.timeout_ms);
+
+    /* a mapping process owns rx_tail */
+    if (atomic_read(&local->mmap_count))
+        return -EBUSY;
+
+    for (;;)
+    {
+        if (mutex_lock_interruptible(&local->read_lock))
+        {
+            err = -ERESTARTSYS;
+            break;
+        }
+
+        while (filled < req.vlen && !rpmsg_ring_empty(&local->ring))
+        {
+            if (copy_from_user(&msg, &uvec[filled], sizeof(msg)))
+            {
+                err = -EFAULT;
+                break;
+            }
+
+            err = rpmsg_rx_take(local, &msg);
+            if (err)
+                break;
+
+            /* the message is gone from the ring, count it regardless */
+            filled++;
+            if (copy_to_user(&uvec[filled - 1], &msg, sizeof(msg)))
+            {
+                err = -EFAULT;
+                break;
+            }
+        }
+
+        mutex_unlock(&local->read_lock);
+
+        if (err || filled >= need || !remaining || (filp->f_flags & O_NONBLOCK))
+            break;
+
+        /* sleep until enough for min is queued, or time runs out */
+        remaining = wait_event_interruptible_timeout(local->usr_wait_q,
+                        rpmsg_ring_count_rcu(&local->ring) >=
+                        min(need - filled, local->ring.mask + 1),
+                        remaining);
+        if (remaining < 0)
+        {
+            err = remaining;
+            break;
+        }
+        /* on timeout take what arrived meanwhile, then stop */
+    }
+
+    req.count = filled;
+    if (copy_to_user(ureq, &req, sizeof(req)))
+        return -EACCES;
+
+    if (filled)
+        return filled;
+    if (!err && (filp->f_flags & O_NONBLOCK))
+        return -EAGAIN;
+
+    return err;
+}
+
+/*
+ * Resize the receive ring.  Queued messages move to the new ring; when it
+ * is smaller the oldest that no longer fit are dropped and counted.
+ */
+static int rpmsg_proxy_resize(struct _rpmsg_params *local, unsigned int slots)
+{
+    int err;
+
+    if (!slots || slots > RPMSG_RING_MAX_SLOTS)
+        return -EINVAL;
+
+    slots = roundup_pow_of_two(slots);
+
+    if (mutex_lock_interruptible(&local->read_lock))
+        return -ERESTARTSYS;
+    mutex_lock(&local->tx_lock);
+
+    if (!local->rpmsg_chnl)
+    {
+        mutex_unlock(&local->tx_lock);
+        mutex_unlock(&local->read_lock);
+        return -ENODEV;
+    }
+
+    /* pairs with rpmsg_dev_mmap() */
+    WRITE_ONCE(local->resizing, 1);
+    smp_mb();
+    if (atomic_read(&local->mmap_count))
+    {
+        err = -EBUSY;
+        goto out;
+    }
+
+    /*
+     * Hold the callback off the way rpmsg_destroy_ept() does, but keep the
+     * address bound: what arrives meanwhile waits in the vring instead of
+     * being dropped by the core for want of a recipient.
+     */
+    mutex_lock(&local->ept->cb_lock);
+    hrtimer_cancel(&local->rx_coalesce_timer);
+    atomic_set(&local->rx_timer_armed, 0);
+
+    /* the byte counters stay valid: queued messages move, trimmed ones count as dropped */
+    err = rpmsg_rings_alloc(local, slots, local->tx_ring.mask + 1);
+
+    /* the coalescing timer is gone, let readers have what was carried over */
+    if (!err && !rpmsg_ring_empty(&local->ring))
+    {
+        WRITE_ONCE(local->rx_flush, 1);
+        wake_up_interruptible(&local->usr_wait_q);
+    }
+    mutex_unlock(&local->ept->cb_lock);
+
+out:
+    WRITE_ONCE(local->resizing, 0);
+    mutex_unlock(&local->tx_lock);
+    mutex_unlock(&local->read_lock);
+
+    return err;
+}
+
+/*
+ * The rpmsg core does not tell us when the remote hands TX buffers back,
+ * so once a try-send failed POLLOUT is withheld for tx_retry_us, then
+ * writers are woken to try again.  Any successful send clears it early.
+ */
+static enum hrtimer_restart rpmsg_tx_retry(struct hrtimer *timer)
+{
+    struct _rpmsg_params *local = container_of(timer, struct _rpmsg_params,
+                                               tx_retry_timer);
+
+    WRITE_ONCE(local->tx_full, 0);
+    wake_up_interruptible(&local->tx_wait_q);
+
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Send one message.  Non-blocking senders use the try path and get
+ * -EAGAIN instead of sleeping in rpmsg_sendto() for a free TX buffer.
+ */
+static int rpmsg_proxy_send(struct _rpmsg_params *local, void *data, int len,
+                            u32 dst, bool nonblock)
+{
+    int err;
+
+    /* tx_lock held: the channel went away under an open file */
+    if (!local->rpmsg_chnl)
+        return -ENODEV;
+
+    if (nonblock)
+    {
+        err = rpmsg_trysendto(local->rpmsg_chnl, data, len, dst);
+        if (err == -ENOMEM)
+        {
+            atomic64_inc(&local->ept_stats.send_fail);
+            WRITE_ONCE(local->tx_full, 1);
+            hrtimer_start(&local->tx_retry_timer,
+                          ns_to_ktime((u64)tx_retry_us * NSEC_PER_USEC),
+                          HRTIMER_MODE_REL);
+            return -EAGAIN;
+        }
+    }
+    else
+    {
+        u64 start = ktime_get_ns();
+
+        err = rpmsg_sendto(local->rpmsg_chnl, data, len, dst);
+        atomic64_add(ktime_get_ns() - start, &local->ept_stats.blocked_ns);
+    }
+
+    if (err)
+    {
+        atomic64_inc(&local->ept_stats.send_fail);
+        pr_err("rpmsg_sendto (size = %d) error: %d\n", len, err);
+        return err;
+    }
+
+    rpmsg_neo_stats_tx(&local->ept_stats, len);
+
+    if (READ_ONCE(local->tx_full))
+    {
+        WRITE_ONCE(local->tx_full, 0);
+        wake_up_interruptible(&local->tx_wait_q);
+    }
+
+    return 0;
+}
+
+/*
+ * Send everything userspace queued on the mapped TX ring.  Slots are
+ * handed to rpmsg_sendto() in place, the only copy is into the vring.
+ * Returns the number of messages sent, or the error if none went out.
+ */
+static int rpmsg_tx_ring_kick(struct _rpmsg_params *local, bool nonblock)
+{
+    struct _rpmsg_ring *ring = &local->tx_ring;
+    u32 pending;
+    int sent = 0;
+    int err = 0;
+
+    if (nonblock)
+    {
+        if (!mutex_trylock(&local->tx_lock))
+            return -EAGAIN;
+    }
+    else if (mutex_lock_interruptible(&local->tx_lock))
+    {
+        return -ERESTARTSYS;
+    }
+
+    /* tx_head is user-writable: at most one ring's worth per kick */
+    pending = rpmsg_ring_pending(ring, smp_load_acquire(ring->head), *ring->tail);
+
+    for (; pending; pending--)
+    {
+        struct rpmsg_neo_slot *slot = &ring->slots[*ring->tail & ring->mask];
+        u32 len = READ_ONCE(slot->len);
+        u32 dst = READ_ONCE(slot->addr);
+
+        if (signal_pending(current))
+        {
+            err = -ERESTARTSYS;
+            break;
+        }
+
+        if (len > MAX_RPMSG_BUFF_SIZE)
+            len = MAX_RPMSG_BUFF_SIZE;
+
+        err = rpmsg_proxy_send(local, slot->data, len,
+                               dst ? dst : local->remote_endpt, nonblock);
+        if (err)
+            break;
+
+        rpmsg_ring_consume(ring);
+        sent++;
+    }
+
+    mutex_unlock(&local->tx_lock);
+
+    return sent ? sent : err;
+}
+
+/* last reference: the device is off the list and its endpoint is gone */
+static void rpmsg_proxy_release(struct kref *ref)
+{
+    struct _rpmsg_device *rdev = container_of(ref, struct _rpmsg_device, ref);
+
+    rpmsg_rings_free(&rdev->rpmsg_params);
+    kfree(rdev);
+}
+
+static void rpmsg_proxy_put(struct _rpmsg_device *rdev)
+{
+    kref_put(&rdev->ref, rpmsg_proxy_release);
+}
+
+static void rpmsg_vm_open(struct vm_area_struct *vma)
+{
+    struct _rpmsg_params *local = vma->vm_private_data;
+
+    atomic_inc(&local->mmap_count);
+    kref_get(&container_of(local, struct _rpmsg_device, rpmsg_params)->ref);
+}
+
+static void rpmsg_vm_close(struct vm_area_struct *vma)
+{
+    struct _rpmsg_params *local = vma->vm_private_data;
+
+    atomic_dec(&local->mmap_count);
+    rpmsg_proxy_put(container_of(local, struct _rpmsg_device, rpmsg_params));
+}
+
+static const struct vm_operations_struct rpmsg_vm_ops =
+{
+    .open  = rpmsg_vm_open,
+    .close = rpmsg_vm_close,
 };
 
-struct _rpmsg_device
-{
-    struct miscdevice 	  device;
-    struct _rpmsg_params  rpmsg_params;
-    int                   endpt;
-};
+static int rpmsg_dev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct _rpmsg_device *_prpmsg_device = ((struct _rpmsg_file *)filp->private_data)->rdev;
+    struct _rpmsg_params *local = ( struct _rpmsg_params *)&_prpmsg_device->rpmsg_params;
+    int err;
+
+    /* pairs with rpmsg_proxy_resize(): one of us sees the other */
+    atomic_inc(&local->mmap_count);
+    smp_mb__after_atomic();
+    if (READ_ONCE(local->resizing))
+    {
+        err = -EBUSY;
+        goto error;
+    }
+
+    if (vma->vm_pgoff ||
+        vma->vm_end - vma->vm_start > local->area_size)
+    {
+        err = -EINVAL;
+        goto error;
+    }
+
+    err = remap_vmalloc_range(vma, local->area, 0);
+    if (err)
+        goto error;
+
+    vma->vm_ops = &rpmsg_vm_ops;
+    vma->vm_private_data = local;
+
+    /* the pages stay mapped after a remove, the area must too */
+    kref_get(&_prpmsg_device->ref);
+
+    return 0;
 
+error:
+    atomic_dec(&local->mmap_count);
+    return err;
+}
 
 
 static int rpmsg_dev_open(struct inode *inode, struct file *filp)
 {
     /* Initialize rpmsg instance with device params from inode */
     struct _rpmsg_device *_prpmsg_device = (struct _rpmsg_device *)filp->private_data;
-    struct _rpmsg_params *local = ( struct _rpmsg_params *)&_prpmsg_device->rpmsg_params;
+    struct _rpmsg_file *rfile;
+
+    /* pairs with rpmsg_proxy_destroy() */
+    atomic_inc(&_prpmsg_device->open_count);
+    smp_mb__after_atomic();
+    if (READ_ONCE(_prpmsg_device->dead))
+    {
+        atomic_dec(&_prpmsg_device->open_count);
+        return -ENODEV;
+    }
+
+    rfile = kzalloc(sizeof(*rfile), GFP_KERNEL);
+    if (!rfile)
+    {
+        atomic_dec(&_prpmsg_device->open_count);
+        return -ENOMEM;
+    }
 
-    local;
+    rfile->rdev = _prpmsg_device;
+    filp->private_data = rfile;
+
+    /* misc_deregister() waits for us, so the device still exists here */
+    kref_get(&_prpmsg_device->ref);
 
     return nonseekable_open(inode, filp);
 }
 
-static ssize_t rpmsg_dev_write(struct file *filp,
-                               const char __user *ubuff, size_t len,
-                               loff_t *p_off)
+static ssize_t rpmsg_dev_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    struct _rpmsg_device *_prpmsg_device = (struct _rpmsg_device *)filp->private_data;
+    struct file *filp = iocb->ki_filp;
+    struct _rpmsg_device *_prpmsg_device = ((struct _rpmsg_file *)filp->private_data)->rdev;
     struct _rpmsg_params *local = ( struct _rpmsg_params *)&_prpmsg_device->rpmsg_params;
+    struct rpmsg_neo_frag_hdr *hdr = (struct rpmsg_neo_frag_hdr *)local->tx_buff;
+
+    bool nonblock = filp->f_flags & O_NONBLOCK;
+    size_t total = iov_iter_count(from);
+    u64 start = ktime_get_ns();
+    size_t sent = 0;
+    size_t hdr_len;
+    size_t size;
+    u8 frag = 0;
+    int err = 0;
 
-    int err;
-    unsigned int size;
+    /* tx_buff is shared by every writer of this device */
+    if (nonblock)
+    {
+        if (!mutex_trylock(&local->tx_lock))
+            return -EAGAIN;
+    }
+    else if (mutex_lock_interruptible(&local->tx_lock))
+    {
+        return -ERESTARTSYS;
+    }
 
-    if (len < MAX_RPMSG_BUFF_SIZE)
-        size = len;
-    else
-        size = MAX_RPMSG_BUFF_SIZE;
+    hdr_len = local->tx_frag ? sizeof(*hdr) : 0;
 
-    if (copy_from_user(local->tx_buff, ubuff, size))
+    /* a zero length write still sends one (empty) message */
+    do
     {
-        pr_err("%s: user to kernel buff copy error.\n", __func__);
-        return -1;
+        size = min_t(size_t, total - sent, MAX_RPMSG_BUFF_SIZE - hdr_len);
+
+        if (copy_from_iter(local->tx_buff + hdr_len, size, from) != size)
+        {
+            pr_err("%s: user to kernel buff copy error.\n", __func__);
+            err = -EFAULT;
+            break;
+        }
+
+        if (hdr_len)
+        {
+            hdr->seq = local->tx_seq;
+            hdr->frag = frag++;
+            hdr->flags = (sent == 0 ? RPMSG_FRAG_FIRST : 0) |
+                         (sent + size == total ? RPMSG_FRAG_LAST : 0);
+        }
+
+        err = rpmsg_proxy_send(local, local->tx_buff, hdr_len + size,
+                               local->remote_endpt, nonblock);
+        if (err)
+            break;
+
+        rpmsg_neo_stats_lat(local->ept_stats.tx_lat, ktime_get_ns() - start);
+        trace_rpmsg_neo_proxy_write(local->endpt, local->remote_endpt,
+                                    hdr_len + size, 0);
+        sent += size;
     }
+    while (sent < total);
 
-    err = rpmsg_sendto(local->rpmsg_chnl,
-                       local->tx_buff,
-                       size,
-                       local->endpt);
-    if (err)
+    local->tx_seq++;
+    mutex_unlock(&local->tx_lock);
+
+    /*
+     * A short write if the channel failed or filled up part way; with
+     * fragment headers the remote sees a write without RPMSG_FRAG_LAST.
+     */
+    return sent ? sent : err;
+}
+
+/*
+ * Spin for the reader's busy-poll budget instead of going to sleep.
+ * Returns true if the ring became ready while spinning.
+ */
+static bool rpmsg_rx_busy_poll(struct _rpmsg_file *rfile, struct _rpmsg_params *local)
+{
+    /* busy_poll_max_us may have been lowered since the budget was set */
+    u64 budget = (u64)min(READ_ONCE(rfile->busy_poll.budget_us),
+                          READ_ONCE(busy_poll_max_us)) * NSEC_PER_USEC;
+    u64 spin = budget;
+    u64 start, now;
+
+    if (!budget)
+        return false;
+
+    if (rfile->busy_poll.adaptive && rfile->spin_ns)
+        spin = min(rfile->spin_ns, budget);
+
+    start = ktime_get_ns();
+    do
     {
-        pr_err("rpmsg_sendto (size = %d) error: %d\n", size, err);
-        size = 0;
+        if (rpmsg_rx_ready_rcu(local))
+        {
+            /* next time spin about twice as long as this wait took */
+            now = ktime_get_ns();
+            rfile->spin_ns = min(budget, max(spin, 2 * (now - start)));
+            return true;
+        }
+
+        if (need_resched() || signal_pending(current))
+            break;
+
+        cpu_relax();
+        now = ktime_get_ns();
     }
+    while (now - start < spin);
 
-    return size;
+    /* data is slower than our spin, back off (but keep a floor) */
+    rfile->spin_ns = max(spin / 2, (u64)NSEC_PER_USEC);
+
+    return false;
 }
 
 static ssize_t rpmsg_dev_read(struct file *filp, char __user *ubuff,
                               size_t len, loff_t *p_off)
 {
-    struct _rpmsg_device *_prpmsg_device = (struct _rpmsg_device *)filp->private_data;
+    struct _rpmsg_file *rfile = filp->private_data;
+    struct _rpmsg_device *_prpmsg_device = rfile->rdev;
     struct _rpmsg_params *local = ( struct _rpmsg_params *)&_prpmsg_device->rpmsg_params;
 
-    int retval;
-    unsigned int data_available, data_used, bytes_copied;
+    ssize_t retval;
 
-    /* Acquire lock to access rpmsg kfifo */
-    static int count = 0;
-    while (mutex_lock_interruptible(&local->sync_lock))
-    {
-        if (!count)
-        {
-            pr_info("%s: error = %d.\n", __func__,mutex_lock_interruptible(&local->sync_lock));
-            count++;
-        }
-    }
+    /* a mapping process owns rx_tail */
+    if (atomic_read(&local->mmap_count))
+        return -EBUSY;
 
-    data_available = kfifo_len(&local->rpmsg_kfifo);
+    if (mutex_lock_interruptible(&local->read_lock))
+        return -ERESTARTSYS;
 
-    if (data_available ==  0)
+    while (!rpmsg_rx_ready(local))
     {
-        /* Release lock */
-        mutex_unlock(&local->sync_lock);
+        /* non-blocking reads don't wait for the low-watermark */
+        if ((filp->f_flags & O_NONBLOCK) && !rpmsg_ring_empty(&local->ring))
+            break;
+
+        mutex_unlock(&local->read_lock);
 
         /* if non-blocking read is requested return error */
         if (filp->f_flags & O_NONBLOCK)
             return -EAGAIN;
 
-        /* Block the calling context till data becomes available */
-        wait_event_interruptible(local->usr_wait_q,
-                                 local->block_flag != 0);
-        while (mutex_lock_interruptible(&local->sync_lock));
-    }
+        /* Block the calling context till enough data is available */
+        if (!rpmsg_rx_busy_poll(rfile, local) &&
+            wait_event_interruptible(local->usr_wait_q,
+                                     rpmsg_rx_ready_rcu(local)))
+            return -ERESTARTSYS;
 
-    /* reset block flag */
-    local->block_flag = 0;
+        if (mutex_lock_interruptible(&local->read_lock))
+            return -ERESTARTSYS;
+    }
 
     /* Provide requested data size to user space */
-    data_available = kfifo_len(&local->rpmsg_kfifo);
-    data_used = (data_available > len) ? len : data_available;
-    retval = kfifo_to_user(&local->rpmsg_kfifo, ubuff, data_used, &bytes_copied);
+    if (local->record_mode)
+        retval = rpmsg_ring_read_record(local, ubuff, len);
+    else
+        retval = rpmsg_ring_read_stream(local, ubuff, len);
 
-    /* Release lock on rpmsg kfifo */
-    mutex_unlock(&local->sync_lock);
+    trace_rpmsg_neo_proxy_read(local->endpt, 0, retval, rpmsg_ring_count(&local->ring));
+    mutex_unlock(&local->read_lock);
 
-    return retval ? retval : bytes_copied;
+    return retval;
 }
 
 static long rpmsg_dev_ioctl(struct file *filp, unsigned int cmd,
                             unsigned long arg)
 {
     unsigned int tmp;
-    struct _rpmsg_device *_prpmsg_device = (struct _rpmsg_device *)filp->private_data;
+    unsigned int start;
+    struct rpmsg_neo_rx_stats stats;
+    struct _rpmsg_device *_prpmsg_device = ((struct _rpmsg_file *)filp->private_data)->rdev;
     struct _rpmsg_params *local = ( struct _rpmsg_params *)&_prpmsg_device->rpmsg_params;
 
     switch (cmd)
     {
     case IOCTL_CMD_GET_KFIFO_SIZE:
-        tmp = kfifo_size(&local->rpmsg_kfifo);
+        tmp = (local->ring.mask + 1) * MAX_RPMSG_BUFF_SIZE;
         if (copy_to_user((unsigned int *)arg, &tmp, sizeof(int)))
             return -EACCES;
         break;
 
     case IOCTL_CMD_GET_AVAIL_DATA_SIZE:
-        tmp = kfifo_len(&local->rpmsg_kfifo);
-        pr_info("kfifo len ioctl = %d ", kfifo_len(&local->rpmsg_kfifo));
+        /* a mapping process owns rx_tail, and can point it anywhere */
+        if (atomic_read(&local->mmap_count))
+            return -EBUSY;
+
+        /* keeps a resize from swapping the ring while we walk it */
+        if (mutex_lock_interruptible(&local->read_lock))
+            return -ERESTARTSYS;
+        tmp = rpmsg_ring_bytes(&local->ring);
+        mutex_unlock(&local->read_lock);
+        pr_info("rx len ioctl = %d ", tmp);
         if (copy_to_user((unsigned int *)arg, &tmp, sizeof(int)))
             return -EACCES;
         break;
     case IOCTL_CMD_GET_FREE_BUFF_SIZE:
-        tmp = kfifo_avail(&local->rpmsg_kfifo);
+        rcu_read_lock();
+        tmp = (local->ring.mask + 1 -
+               min(rpmsg_ring_count(&local->ring), local->ring.mask + 1)) *
+              MAX_RPMSG_BUFF_SIZE;
+        rcu_read_unlock();
         if (copy_to_user((unsigned int *)arg, &tmp, sizeof(int)))
             return -EACCES;
         break;
 
-    default:
-        return -EINVAL;
+    case IOCTL_CMD_SET_RECORD_MODE:
+        if (arg > RPMSG_MODE_RECORD_TS)
+            return -EINVAL;
+
+        if (mutex_lock_interruptible(&local->read_lock))
+            return -ERESTARTSYS;
+
+        /* a partly read message is delivered whole in record mode */
+        local->record_mode = arg;
+        local->ring.offset = 0;
+        mutex_unlock(&local->read_lock);
+        break;
+
+    case IOCTL_CMD_SET_TX_FRAG:
+        if (mutex_lock_interruptible(&local->tx_lock))
+            return -ERESTARTSYS;
+        local->tx_frag = !!arg;
+        mutex_unlock(&local->tx_lock);
+        break;
+
+    case IOCTL_CMD_GET_TX_FRAG:
+        tmp = local->tx_frag;
+        if (copy_to_user((unsigned int *)arg, &tmp, sizeof(int)))
+            return -EACCES;
+        break;
+
+    case IOCTL_CMD_SET_RX_TSTAMP:
+        if (arg > RPMSG_TSTAMP_CYCLES)
+            return -EINVAL;
+        WRITE_ONCE(local->rx_tstamp, arg);
+        break;
+
+    case IOCTL_CMD_GET_RX_TSTAMP:
+        tmp = local->rx_tstamp;
+        if (copy_to_user((unsigned int *)arg, &tmp, sizeof(int)))
+            return -EACCES;
+        break;
+
+    case IOCTL_CMD_SET_RX_LOWAT:
+    {
+        struct rpmsg_neo_rx_lowat lowat;
+
+        if (copy_from_user(&lowat, (void __user *)arg, sizeof(lowat)))
+            return -EACCES;
+
+        WRITE_ONCE(local->lowat.msgs, lowat.msgs);
+        WRITE_ONCE(local->lowat.bytes, lowat.bytes);
+        WRITE_ONCE(local->lowat.coalesce_us, lowat.coalesce_us);
+
+        /* lowered thresholds may already be met */
+        wake_up_interruptible(&local->usr_wait_q);
+        break;
     }
 
-    return 0;
-}
+    case IOCTL_CMD_GET_RX_LOWAT:
+        if (copy_to_user((void __user *)arg, &local->lowat, sizeof(local->lowat)))
+            return -EACCES;
+        break;
 
-static unsigned int rpmsg_dev_poll(struct file *filp, poll_table *wait)
-{
-    unsigned int mask = POLLOUT | POLLWRNORM; //POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
-    struct _rpmsg_device *_prpmsg_device = (struct _rpmsg_device *)filp->private_data;
-    struct _rpmsg_params *local = ( struct _rpmsg_params *)&_prpmsg_device->rpmsg_params;
+    case IOCTL_CMD_SET_BUSY_POLL:
+    {
+        struct _rpmsg_file *rfile = filp->private_data;
+        struct rpmsg_neo_busy_poll busy_poll;
+
+        if (copy_from_user(&busy_poll, (void __user *)arg, sizeof(busy_poll)))
+            return -EACCES;
+
+        /* every fd holder could otherwise spin a CPU for as long as it likes */
+        if (busy_poll.budget_us > READ_ONCE(busy_poll_max_us))
+            return -EINVAL;
+
+        rfile->busy_poll.adaptive = !!busy_poll.adaptive;
+        WRITE_ONCE(rfile->busy_poll.budget_us, busy_poll.budget_us);
+        rfile->spin_ns = 0;
+        break;
+    }
+
+    case IOCTL_CMD_GET_BUSY_POLL:
+    {
+        struct _rpmsg_file *rfile = filp->private_data;
+
+        if (copy_to_user((void __user *)arg, &rfile->busy_poll, sizeof(rfile->busy_poll)))
+            return -EACCES;
+        break;
+    }
+
+    case IOCTL_CMD_GET_RECORD_MODE:
+        tmp = local->record_mode;
+        if (copy_to_user((unsigned int *)arg, &tmp, sizeof(int)))
+            return -EACCES;
+        break;
+
+    case IOCTL_CMD_GET_MMAP_SIZE:
+        tmp = local->area_size;
+        if (copy_to_user((unsigned int *)arg, &tmp, sizeof(int)))
+            return -EACCES;
+        break;
+
+    case IOCTL_CMD_MMAP_TX_KICK:
+        return rpmsg_tx_ring_kick(local, filp->f_flags & O_NONBLOCK);
+
+    case IOCTL_CMD_SET_RX_SLOTS:
+        return rpmsg_proxy_resize(local, arg);
+
+    case IOCTL_CMD_GET_RX_SLOTS:
+        tmp = local->ring.mask + 1;
+        if (copy_to_user((unsigned int *)arg, &tmp, sizeof(int)))
+            return -EACCES;
+        break;
+
+    case IOCTL_CMD_SET_OVERFLOW_POLICY:
+        if (arg > RPMSG_OVERFLOW_BLOCK_REMOTE)
+            return -EINVAL;
+
+        /* rpmsg_rx_copy() decides on the policy under read_lock */
+        if (mutex_lock_interruptible(&local->read_lock))
+            return -ERESTARTSYS;
+        WRITE_ONCE(local->overflow_policy, arg);
+        mutex_unlock(&local->read_lock);
+
+        /* let a blocked callback re-evaluate */
+        wake_up(&local->space_wait_q);
+        break;
+
+    case IOCTL_CMD_GET_OVERFLOW_POLICY:
+        tmp = local->overflow_policy;
+        if (copy_to_user((unsigned int *)arg, &tmp, sizeof(int)))
+            return -EACCES;
+        break;
+
+    case IOCTL_CMD_SET_RX_BLOCK_MS:
+        if (arg > RPMSG_BLOCK_MS_MAX)
+            return -EINVAL;
+
+        /* a callback already waiting keeps its old timeout */
+        WRITE_ONCE(local->block_ms, arg);
+        break;
 
+    case IOCTL_CMD_GET_RX_BLOCK_MS:
+        tmp = local->block_ms;
+        if (copy_to_user((unsigned int *)arg, &tmp, sizeof(int)))
+            return -EACCES;
+        break;
 
-    if( local)
+    case IOCTL_CMD_CREATE_DEVICE:
     {
-        unsigned int data_available;
+        struct rpmsg_neo_dev_req req;
+        int index;
 
-        if (mutex_lock_interruptible(&local->sync_lock))
-            return mask;
+        if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+            return -EACCES;
+
+        index = rpmsg_proxy_create(req.local, req.remote);
+        if (index < 0)
+            return index;
+
+        req.index = index;
+        if (copy_to_user((void __user *)arg, &req, sizeof(req)))
+            return -EACCES;
+        break;
+    }
 
-        poll_wait(filp,&local->usr_wait_q, wait );
+    case IOCTL_CMD_DESTROY_DEVICE:
+        return rpmsg_proxy_destroy(arg);
 
-        data_available = kfifo_len(&local->rpmsg_kfifo);
+    case IOCTL_CMD_RECV_BATCH:
+        return rpmsg_rx_batch(filp, local, (struct rpmsg_neo_mmsg_req __user *)arg);
 
-        if (data_available)
+    case IOCTL_CMD_GET_RX_STATS:
+        do
         {
-            mask |= POLLIN | POLLRDNORM;
+            start = u64_stats_fetch_begin(&local->stats_sync);
+            stats = local->stats;
         }
+        while (u64_stats_fetch_retry(&local->stats_sync, start));
+
+        if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+            return -EACCES;
+        break;
+
+    default:
+        return -EINVAL;
     }
 
-    mutex_unlock(&local->sync_lock);
+    return 0;
+}
+
+static unsigned int rpmsg_dev_poll(struct file *filp, poll_table *wait)
+{
+    unsigned int mask = 0;
+    struct _rpmsg_device *_prpmsg_device = ((struct _rpmsg_file *)filp->private_data)->rdev;
+    struct _rpmsg_params *local = ( struct _rpmsg_params *)&_prpmsg_device->rpmsg_params;
+
+    poll_wait(filp, &local->usr_wait_q, wait);
+    poll_wait(filp, &local->tx_wait_q, wait);
+
+    if (!READ_ONCE(local->tx_full))
+        mask |= POLLOUT | POLLWRNORM;
+
+    if (rpmsg_rx_ready_rcu(local))
+        mask |= POLLIN | POLLRDNORM;
+
     return mask;
 }
 
 
 static int rpmsg_dev_release(struct inode *inode, struct file *p_file)
 {
+    struct _rpmsg_file *rfile = p_file->private_data;
+    struct _rpmsg_device *_prpmsg_device = rfile->rdev;
+
+    kfree(rfile);
+    atomic_dec(&_prpmsg_device->open_count);
+    rpmsg_proxy_put(_prpmsg_device);
+
     return 0;
 }
 
+/*
+ * The receive ring is full: apply the overflow policy.  Returns true if
+ * the callback may now write slot 'head'.
+ */
+static bool rpmsg_rx_make_room(struct _rpmsg_params *local, u32 head)
+{
+    struct _rpmsg_ring *ring = &local->ring;
+    u32 tail;
+
+    switch (READ_ONCE(local->overflow_policy))
+    {
+    case RPMSG_OVERFLOW_DROP_OLDEST:
+        if (atomic_read(&local->mmap_count))
+            break;
+
+        /* take the oldest slot away from the reader, see rpmsg_rx_copy() */
+        tail = READ_ONCE(*ring->tail);
+        while (head - tail > ring->mask)
+        {
+            u32 len = min_t(u32, READ_ONCE(ring->slots[tail & ring->mask].len),
+                            MAX_RPMSG_BUFF_SIZE);
+            u32 seen = cmpxchg(ring->tail, tail, tail + 1);
+
+            if (seen == tail)
+            {
+                local->rx_bytes_dropped += len;
+                rpmsg_rx_stat_inc(local, drop_oldest);
+                atomic64_inc(&local->ept_stats.drops);
+                break;
+            }
+            tail = seen;
+        }
+        return true;
+
+    case RPMSG_OVERFLOW_BLOCK_REMOTE:
+        rpmsg_rx_stat_inc(local, blocked);
+
+        /* a mapping reader does not wake us, rely on the timeout */
+        if (wait_event_timeout(local->space_wait_q,
+                               head - smp_load_acquire(ring->tail) <= ring->mask ||
+                               READ_ONCE(local->overflow_policy) != RPMSG_OVERFLOW_BLOCK_REMOTE,
+                               msecs_to_jiffies(READ_ONCE(local->block_ms))) &&
+            head - smp_load_acquire(ring->tail) <= ring->mask)
+            return true;
+
+        rpmsg_rx_stat_inc(local, block_timeout);
+        return false;
+    }
+
+    rpmsg_rx_stat_inc(local, drop_full);
+    return false;
+}
+
 static void rpmsg_proxy_dev_ept_cb(struct rpmsg_channel *rpdev, void *data,
                                    int len, void *priv, u32 src)
 {
 
     struct _rpmsg_params *local = ( struct _rpmsg_params *)priv;
+    struct _rpmsg_ring *ring = &local->ring;
+    struct rpmsg_neo_slot *slot;
+    u32 head = *ring->head;
+    u64 ts = rpmsg_rx_tstamp(local);
+    u32 depth;
+
+    rpmsg_neo_stats_rx(&local->ept_stats, len);
 
-    while(mutex_lock_interruptible(&local->sync_lock));
-    if (kfifo_avail(&local->rpmsg_kfifo) < len)
+    if (len > MAX_RPMSG_BUFF_SIZE)
     {
-        mutex_unlock(&local->sync_lock);
+        rpmsg_rx_stat_inc(local, drop_oversize);
+        atomic64_inc(&local->ept_stats.drops);
         return;
     }
 
-    kfifo_in(&local->rpmsg_kfifo, data, (unsigned int)len);
+    /* ring full: drop, or make room as the overflow policy says */
+    if (head - smp_load_acquire(ring->tail) > ring->mask &&
+        !rpmsg_rx_make_room(local, head))
+    {
+        atomic64_inc(&local->ept_stats.drops);
+        return;
+    }
 
-    mutex_unlock(&local->sync_lock);
+    slot = &ring->slots[head & ring->mask];
+    slot->addr = src;
+    slot->len = len;
+    slot->ts = ts;
+    memcpy(slot->data, data, len);
+
+    /* publish the slot, then wake up readers once the low-watermark is met */
+    WRITE_ONCE(local->rx_bytes_in, local->rx_bytes_in + len);
+    smp_store_release(ring->head, head + 1);
+    rpmsg_rx_stat_inc(local, rx_msgs);
+    depth = head + 1 - READ_ONCE(*ring->tail);
+    rpmsg_neo_stats_queue(&local->ept_stats, depth);
+    trace_rpmsg_neo_proxy_rx(local->endpt, src, len, depth);
+    smp_mb();
+    if (rpmsg_rx_ready(local) && waitqueue_active(&local->usr_wait_q))
+    {
+        atomic64_inc(&local->ept_stats.wakeups);
+        wake_up_interruptible(&local->usr_wait_q);
+    }
 
-    /* Wake up any blocking contexts waiting for data */
-    local->block_flag = 1;
-    wake_up_interruptible(&local->usr_wait_q);
+    /*
+     * Armed even when we just woke someone: the reader may clear rx_flush
+     * after seeing an empty ring, and this message must not wait for more.
+     */
+    if (READ_ONCE(local->lowat.coalesce_us) &&
+        !atomic_xchg(&local->rx_timer_armed, 1))
+        hrtimer_start(&local->rx_coalesce_timer,
+                      ns_to_ktime((u64)local->lowat.coalesce_us * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL);
 
 }
 static const struct file_operations rpmsg_dev_fops =
 {
     .owner = THIS_MODULE,
     .read = rpmsg_dev_read,
-    .write = rpmsg_dev_write,
+    .write_iter = rpmsg_dev_write_iter,
     .open = rpmsg_dev_open,
     .unlocked_ioctl = rpmsg_dev_ioctl,
     .release = rpmsg_dev_release,
     .llseek =	no_llseek,
     .poll		= rpmsg_dev_poll,
+    .mmap		= rpmsg_dev_mmap,
 
 };
 
 
-static struct _rpmsg_device rpmsg_miscdevice0 =
-{
-    .device.minor = MISC_DYNAMIC_MINOR,
-    .device.name  = "rpmsg0",
-    .device.fops = &rpmsg_dev_fops,
-    .endpt = RPMSG_PROXY_ENDPOINT,
-
-};
-
-
-static int rpmsg_neo_proxy_remove(void )
-{
-    misc_deregister(&rpmsg_miscdevice0.device);
-
-    return 0;
-
-}
-
 static int init_neo_proxy(struct _rpmsg_params *local, struct rpmsg_channel *rpmsg_chnl)
 {
     int status =0;
 
-    /* Initialize mutex */
-    mutex_init(&local->sync_lock);
+    /* Initialize reader and tx ring locks */
+    mutex_init(&local->read_lock);
+    mutex_init(&local->tx_lock);
 
     /* Initialize wait queue head that provides blocking rx for userspace */
     init_waitqueue_head(&local->usr_wait_q);
-
-    /* Allocate kfifo for rpmsg */
-    status = kfifo_alloc(&local->rpmsg_kfifo, RPMSG_KFIFO_SIZE, GFP_KERNEL);
-    kfifo_reset(&local->rpmsg_kfifo);
-
+    init_waitqueue_head(&local->space_wait_q);
+    init_waitqueue_head(&local->tx_wait_q);
+    u64_stats_init(&local->stats_sync);
+
+    hrtimer_init(&local->tx_retry_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    local->tx_retry_timer.function = rpmsg_tx_retry;
+
+    hrtimer_init(&local->rx_coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    local->rx_coalesce_timer.function = rpmsg_rx_coalesce;
+    atomic_set(&local->rx_timer_armed, 0);
+    local->lowat.msgs = 0;
+    local->lowat.bytes = 0;
+    local->lowat.coalesce_us = 0;
+
+    /* Allocate the receive and transmit rings */
+    status = rpmsg_rings_alloc(local,
+                               roundup_pow_of_two(clamp_t(unsigned int, rx_slots, 1, RPMSG_RING_MAX_SLOTS)),
+                               RPMSG_TX_RING_SLOTS);
     if (status)
     {
-        pr_err("ERROR: %s %d Failed to run kfifo_alloc. rc=%d\n", __FUNCTION__, __LINE__,status);
+        pr_err("ERROR: %s %d Failed to allocate rings. rc=%d\n", __FUNCTION__, __LINE__,status);
         goto error0;
     }
 
     local->rpmsg_chnl = rpmsg_chnl;
-    local->block_flag = 0;
+    local->record_mode = RPMSG_MODE_STREAM;
+    local->rx_tstamp = RPMSG_TSTAMP_MONOTONIC;
+    local->overflow_policy = min_t(unsigned int, rx_overflow, RPMSG_OVERFLOW_BLOCK_REMOTE);
+    local->block_ms = rx_block_ms;
 
     local->ept = rpmsg_create_ept(local->rpmsg_chnl,
                                   rpmsg_proxy_dev_ept_cb,
@@ -310,14 +1778,13 @@ static int init_neo_proxy(struct _rpmsg_params *local, struct rpmsg_channel *rpm
                                   local->endpt);
     if (!local->ept)
     {
-        pr_err("ERROR: %s %d Failed to create endpoint.\n",  __FUNCTION__, __LINE__);
+        pr_err("ERROR: %s %d Failed to create endpoint %d.\n",  __FUNCTION__, __LINE__, local->endpt);
         goto error1;
     }
     goto out;
 
-//TCM        rpmsg_destroy_ept(local->ept);
 error1:
-    kfifo_free(&local->rpmsg_kfifo);
+    rpmsg_rings_free(local);
 error0:
 
     pr_err("ERROR: %s %d\n",  __FUNCTION__, __LINE__);
@@ -327,37 +1794,173 @@ out:
     return 0;
 }
 
-int rpmsg_neo_proxy(struct rpmsg_channel *rpmsg_chnl,rpmsg_neo_remove_t *remove_func )
+/* stops all traffic; open files and mappings keep the rings until the last put */
+static void deinit_neo_proxy(struct _rpmsg_params *local)
 {
-    int err = 0;
-
-    *remove_func =  rpmsg_neo_proxy_remove;
+    /* resize and the senders hold tx_lock, after this they see no channel */
+    mutex_lock(&local->tx_lock);
+    if (local->ept)
+        rpmsg_destroy_ept(local->ept);
+    local->ept = NULL;
+    local->rpmsg_chnl = NULL;
+    mutex_unlock(&local->tx_lock);
+
+    /* the callback could re-arm them until the endpoint is gone */
+    hrtimer_cancel(&local->tx_retry_timer);
+    hrtimer_cancel(&local->rx_coalesce_timer);
+}
 
-    pr_info(" %s %d\n",  __FUNCTION__, __LINE__);
+/* returns N of the new /dev/rpmsgN */
+static int rpmsg_proxy_create(u32 local_endpt, u32 remote_endpt)
+{
+    struct _rpmsg_device *rdev;
+    int err;
 
-    memset(&rpmsg_miscdevice0.rpmsg_params, 0, sizeof(struct _rpmsg_params));
+    rdev = kzalloc(sizeof(*rdev), GFP_KERNEL);
+    if (!rdev)
+        return -ENOMEM;
+    kref_init(&rdev->ref);
 
-    rpmsg_miscdevice0.rpmsg_params.endpt = rpmsg_miscdevice0.endpt;
+    /* held throughout, so a remove cannot pull the channel from under us */
+    mutex_lock(&rpmsg_proxy_lock);
+    if (!rpmsg_proxy_chnl)
+    {
+        err = -ENODEV;
+        goto error0;
+    }
 
-    if ((err= init_neo_proxy(&rpmsg_miscdevice0.rpmsg_params, rpmsg_chnl)))
+    rdev->index = ida_simple_get(&rpmsg_proxy_ida, 0, 0, GFP_KERNEL);
+    if (rdev->index < 0)
     {
-        pr_err("ERROR:  %s %d rc=%d\n", __FUNCTION__, __LINE__,err);
+        err = rdev->index;
         goto error0;
     }
 
-    err = misc_register(&rpmsg_miscdevice0.device);
-    if(err)
+    snprintf(rdev->name, sizeof(rdev->name), "rpmsg%d", rdev->index);
+    rdev->device.minor = MISC_DYNAMIC_MINOR;
+    rdev->device.name = rdev->name;
+    rdev->device.fops = &rpmsg_dev_fops;
+    rdev->endpt = local_endpt;
+    atomic_set(&rdev->open_count, 0);
+
+    rdev->rpmsg_params.endpt = local_endpt;
+    rdev->rpmsg_params.remote_endpt = remote_endpt;
+
+    if ((err = init_neo_proxy(&rdev->rpmsg_params, rpmsg_proxy_chnl)))
+    {
+        /* most likely the endpoint address is already taken */
+        err = -EADDRINUSE;
+        goto error1;
+    }
+
+    err = misc_register(&rdev->device);
+    if (err)
     {
         pr_err("ERROR:  %s %d rc=%d\n",  __FUNCTION__, __LINE__,err);
+        goto error2;
     }
-    else
+
+    list_add_tail(&rdev->node, &rpmsg_proxy_devices);
+
+    rpmsg_neo_stats_register(&rdev->rpmsg_params.ept_stats, rdev->name);
+    mutex_unlock(&rpmsg_proxy_lock);
+
+    pr_info("Loaded: /dev/%s endpt %d -> %d\n", rdev->name, local_endpt, remote_endpt);
+
+    return rdev->index;
+
+error2:
+    deinit_neo_proxy(&rdev->rpmsg_params);
+    rpmsg_rings_free(&rdev->rpmsg_params);
+error1:
+    ida_simple_remove(&rpmsg_proxy_ida, rdev->index);
+error0:
+    mutex_unlock(&rpmsg_proxy_lock);
+    kfree(rdev);
+    return err;
+}
+
+/*
+ * rpmsg_proxy_lock held.  Unlinks rdev and stops its traffic, then drops
+ * the list's reference: open files and mappings may still hold theirs.
+ */
+static void rpmsg_proxy_free(struct _rpmsg_device *rdev)
+{
+    WRITE_ONCE(rdev->dead, 1);
+    list_del(&rdev->node);
+    rpmsg_neo_stats_unregister(&rdev->rpmsg_params.ept_stats);
+    misc_deregister(&rdev->device);
+    deinit_neo_proxy(&rdev->rpmsg_params);
+    ida_simple_remove(&rpmsg_proxy_ida, rdev->index);
+    rpmsg_proxy_put(rdev);
+}
+
+static int rpmsg_proxy_destroy(int index)
+{
+    struct _rpmsg_device *rdev;
+    int err = -ENOENT;
+
+    /* /dev/rpmsg0 carries the control ioctls, it lives as long as the channel */
+    if (index == 0)
+        return -EPERM;
+
+    mutex_lock(&rpmsg_proxy_lock);
+    list_for_each_entry(rdev, &rpmsg_proxy_devices, node)
     {
-        pr_info("Loaded:  %s %d\n",  __FUNCTION__, __LINE__);
+        if (rdev->index != index)
+            continue;
+
+        /* pairs with rpmsg_dev_open() */
+        WRITE_ONCE(rdev->dead, 1);
+        smp_mb();
+        if (atomic_read(&rdev->open_count) ||
+            atomic_read(&rdev->rpmsg_params.mmap_count))
+        {
+            WRITE_ONCE(rdev->dead, 0);
+            err = -EBUSY;
+            break;
+        }
 
+        rpmsg_proxy_free(rdev);
+        err = 0;
+        break;
     }
+    mutex_unlock(&rpmsg_proxy_lock);
 
-error0:
     return err;
+}
+
+static int rpmsg_neo_proxy_remove(void )
+{
+    struct _rpmsg_device *rdev, *tmp;
+
+    mutex_lock(&rpmsg_proxy_lock);
+    list_for_each_entry_safe(rdev, tmp, &rpmsg_proxy_devices, node)
+        rpmsg_proxy_free(rdev);
+    rpmsg_proxy_chnl = NULL;
+    mutex_unlock(&rpmsg_proxy_lock);
+
+    return 0;
 
 }
 
+int rpmsg_neo_proxy(struct rpmsg_channel *rpmsg_chnl,rpmsg_neo_remove_t *remove_func )
+{
+    int err = 0;
+
+    *remove_func =  rpmsg_neo_proxy_remove;
+
+    pr_info(" %s %d\n",  __FUNCTION__, __LINE__);
+
+    rpmsg_proxy_chnl = rpmsg_chnl;
+
+    err = rpmsg_proxy_create(RPMSG_PROXY_ENDPOINT, RPMSG_PROXY_ENDPOINT);
+    if (err < 0)
+    {
+        pr_err("ERROR:  %s %d rc=%d\n", __FUNCTION__, __LINE__,err);
+        return err;
+    }
+
+    return 0;
+
+}
@@ -10,5 +10,7 @@
 //Next release will remove the MAC ADDRESS info, it is not needed
 #define ETHERNET_PDU_SIZE       (MAX_RPMSG_BUFF_SIZE)
 #define ETHERNET_MTU_SIZE       ((MAX_RPMSG_BUFF_SIZE) - (12 +2))
+//raw-IP mode (ether_raw_ip=1) sends the IP packet alone
+#define RAW_IP_MTU_SIZE         (MAX_RPMSG_BUFF_SIZE)
 
 